@@ -1 +1,6 @@
-g++ -std=c++20 -Wall -o build/server src/main.cpp src/hw_peripherals.cpp src/acquirer.cpp src/server.cpp -lbcm2835 -lpthread -lrt
+g++ -std=c++20 -D_FILE_OFFSET_BITS=64 -Wall -o build/server src/main.cpp src/hw_peripherals.cpp src/acquirer.cpp src/cadence.cpp src/recorder.cpp src/server.cpp src/spectrum.cpp src/calibration.cpp src/shm_publisher.cpp src/feedback.cpp src/logger.cpp src/board_calibration.cpp -lbcm2835 -lpthread -lrt
+
+g++ -std=c++20 -D_FILE_OFFSET_BITS=64 -O2 -Wall -o build/ocmfet-convert src/convert.cpp src/recording.cpp -lpthread
+g++ -std=c++20 -D_FILE_OFFSET_BITS=64 -O2 -Wall -o build/ocmfet-analyze src/analyze.cpp src/recording.cpp -lpthread
+g++ -std=c++20 -D_FILE_OFFSET_BITS=64 -O2 -Wall -o build/ocmfet-client src/client.cpp src/recording.cpp -lpthread
+g++ -std=c++20 -D_FILE_OFFSET_BITS=64 -O2 -Wall -o build/ocmfet-shm-example src/shm_example.cpp src/shm_reader.cpp -lrt
@@ -1,12 +1,13 @@
 #include "acquirer.hpp"
+#include "logger.hpp"
 #include "server.hpp"
 
-#include <chrono>
-#include <cstring>
+#include <algorithm>
 #include <iomanip>
-#include <iostream>
 #include <sstream>
 #include <string_view>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,60 +15,92 @@
   "$I_{ds_{" + (x) + "}}=-" + (y) + "\\text{ }\\mu \\text{A}$"
 #define VG_LATEX(x, y) "$V_{g_{" + (x) + "}}=-" + (y) + "\\text{ V}$"
 
-Acquirer::Acquirer(std::string_view data_folder, float T2)
-    : acquiring_(false), recording_(false), paused_(false), T2_(T2), iter_(0),
-      use_buffer_(0), proc_buffer_(0), memoffset_(0), data_folder_(data_folder),
-      tags_("") {
+Acquirer::Acquirer(std::string_view data_folder, float T2, Board& board)
+    : running_(false), acquiring_(false), recording_(false), paused_(false),
+      server_(nullptr), board_(board), info_(::frameInfo(board.cfg.variant)),
+      T2_(T2), iter_(0), use_buffer_(0), proc_buffer_(0), frame_ready_(false),
+      ack_ns_(0), read_ns_(0), data_folder_(data_folder), preroll_s_(0),
+      ua_stream_(false), acquired_(0), processed_(0), overruns_(0),
+      send_failures_(0), max_service_ns_(0),
+      ring_(HISTORY_SECONDS * 1e6 / (info_.n_samples * T2), info_.frame_len),
+      recorder_(ring_, data_folder, board.cal.meta()),
+      spectrum_(info_, board.cfg.id, board.cal),
+      shm_(board.cfg.id, info_, T2, board.cal),
+      feedback_(board, info_, T2, [this](const Feedback::Actuation& a) {
+        if (recording_ && !paused_)
+          recorder_.tag(Feedback::describe(a), a.frame);
+      }) {
+  cadence_.setNominal(info_.n_samples * T2_);
+
   // Check if the data folder exists and create it if it doesn't
   struct stat info;
 
   if (stat(data_folder_.c_str(), &info) != 0) {
-    std::cout << "Creating data folder..." << '\n';
+    LOG_INFO("Creating data folder...");
     if (mkdir(data_folder_.c_str(), 0777) != 0) {
-      std::cerr << "Error creating data folder" << '\n';
+      LOG_ERROR("Error creating data folder");
       return;
     }
   }
 
-  // Allocate memory for the data
-  memblock_ = malloc(MEM_SIZE);
-  if (memblock_ == NULL) {
-    std::cerr << "Error allocating memory" << '\n';
-    return;
-  }
-
-  std::cout << "Memory allocated: " << std::hex << memblock_ << std::dec
-            << '\n';
+  LOG_INFO("History buffer: {} kB ({} s)", ring_.bytes() / 1024,
+           historySeconds());
+  LOG_INFO("Board {} variant: {} ({} bytes/frame)", board_.cfg.id, info_.name,
+           info_.frame_len);
   // setT2(T2);
 }
 
 Acquirer::~Acquirer() {
-  // Free the memory
-  free(memblock_);
-  std::cout << "Memory freed." << '\n';
+  // Join the threads before the buffers they use are destroyed
+  spectrum_.stop();
+  stopThreads();
+  if (acqThread_.joinable())
+    acqThread_.join();
+  if (procThread_.joinable())
+    procThread_.join();
+}
+
+// Pin a thread to a CPU core, if one is configured
+static void pinThread(std::jthread& thread, int core) {
+  if (core < 0)
+    return;
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(core, &cpuset);
+  if (pthread_setaffinity_np(thread.native_handle(), sizeof(cpuset),
+                             &cpuset) != 0)
+    LOG_ERROR("Error pinning thread to core {}", core);
 }
 
 // SendData callback
 void Acquirer::startThreads(Server* server) {
   running_ = true;
-  std::cout << "Starting acquisition and processing threads..." << '\n';
-  acqThread_  = std::jthread(&Acquirer::acquireData, this);
-  procThread_ = std::jthread(&Acquirer::processData, this, server);
-  std::cout << "Threads started." << '\n';
+  server_  = server;
+  LOG_INFO("Starting acquisition and processing threads...");
+  // Instantiate the acquisition and processing loops for the board layout
+  visitLayout(info_.variant, [this, server](auto layout) {
+    using L     = decltype(layout);
+    acqThread_  = std::jthread(&Acquirer::acquireData<L>, this);
+    procThread_ = std::jthread(&Acquirer::processData<L>, this, server);
+  });
+  pinThread(acqThread_, board_.cfg.acq_core);
+  pinThread(procThread_, board_.cfg.proc_core);
+  LOG_INFO("Threads started.");
 }
 
 void Acquirer::stopThreads() {
   std::unique_lock<std::mutex> lock(dataMutex);
-  acquiring_ = true;
-  acqCV.notify_all();
   running_ = false;
+  acqCV.notify_all();
   dataCV.notify_all();
   lock.unlock();
 }
 
 void Acquirer::start() {
+  cadence_.reset();
   acquiring_ = true;
-  set_T2lock(0);
+  set_T2lock(board_, 0);
   acqCV.notify_one();
 }
 
@@ -80,68 +113,74 @@ void Acquirer::startRecording() {
 }
 
 void Acquirer::startRecording(std::string_view filename) {
-  filename_ = filename;
-  tags_     = "time,tag\n";
+  // Include the last preroll_s_ seconds from the history ring
+  recorder_.start(filename, info_, T2_,
+                  preroll_s_ * 1e6 / (info_.n_samples * T2_));
 
   startRecording();
 }
 
-void Acquirer::pauseRecording() { paused_ = true; }
+void Acquirer::pauseRecording() {
+  paused_ = true;
+  recorder_.pause();
+}
 
-void Acquirer::resumeRecording() { paused_ = false; }
+void Acquirer::resumeRecording() {
+  recorder_.resume();
+  paused_ = false;
+}
 
 std::vector<std::string> Acquirer::stopRecording() {
   recording_ = false;
   paused_    = false;
 
-  return saveRecording();
+  // Blocks until the last segment is on disk
+  return recorder_.stop();
 }
 
-std::vector<std::string> Acquirer::saveRecording() {
-  auto   now{std::chrono::system_clock::now()};
-  time_t now_c{std::chrono::system_clock::to_time_t(now)};
-
-  std::stringstream ss;
-  ss << std::put_time(std::localtime(&now_c), "%Y%m%d_%H%M%S");
-
-  std::string filename{data_folder_ + filename_ + "_" + ss.str() + ".bin"};
-  std::string tags_filename{data_folder_ + filename_ + "_" + ss.str() +
-                            ".tags"};
-
-  // Open the file
-  FILE* fp{fopen(filename.c_str(), "wb")};
-  if (fp == NULL) {
-    std::cerr << "Error opening file" << '\n';
-    return std::vector<std::string>{};
-  }
-
-  // Write the data
-  fwrite(memblock_, 1, memoffset_, fp);
+void Acquirer::setRotation(uint64_t max_mb, unsigned int max_minutes) {
+  recorder_.setRotation(max_mb, max_minutes);
+}
 
-  // Close the file
-  fclose(fp);
+float Acquirer::setPreroll(float seconds) {
+  // The writer needs some room in the ring to catch up with the producer
+  preroll_s_ = std::clamp(seconds, 0.0f, historySeconds() * 3 / 4);
+  return preroll_s_;
+}
 
-  // Open the tags file
-  fp = fopen(tags_filename.c_str(), "w");
-  if (fp == NULL) {
-    std::cerr << "Error opening tags file" << '\n';
-    return std::vector<std::string>{};
-  }
+std::string Acquirer::snapshot(std::string_view name) {
+  return recorder_.snapshot(name, info_, T2_, ring_.capacity());
+}
 
-  // Write the tags
-  fwrite(tags_.c_str(), 1, tags_.length(), fp);
+float Acquirer::historySeconds() const {
+  return ring_.capacity() * info_.n_samples * T2_ / 1e6;
+}
 
-  // Close the file
-  fclose(fp);
+PipelineStats Acquirer::pipelineStats() const {
+  return PipelineStats{acquired_,
+                       processed_,
+                       overruns_,
+                       send_failures_,
+                       cadence_.gaps(),
+                       recorder_.lostFrames(),
+                       recorder_.active() ? recorder_.backlog() : 0,
+                       max_service_ns_};
+}
 
-  // Reset the memory offset
-  memoffset_ = 0;
+size_t Acquirer::startSpectrum(size_t nfft) {
+  if (!FFT::isPowerOfTwo(nfft) || nfft < 64 || nfft > 32768)
+    nfft = SPECTRUM_NFFT;
 
-  return std::vector<std::string>{filename, tags_filename};
+  spectrum_.start(nfft, T2_, [this](const char* msg, size_t len) {
+    server_->sendSpectrum(msg, len);
+  });
+  return nfft;
 }
 
+void Acquirer::stopSpectrum() { spectrum_.stop(); }
+
 std::vector<std::string> Acquirer::stop() {
-  set_T2lock(1);
+  set_T2lock(board_, 1);
   acquiring_ = false;
   iter_      = 0;
 
@@ -151,55 +190,85 @@ std::vector<std::string> Acquirer::stop() {
     return std::vector<std::string>{};
 }
 
-void Acquirer::tagRecording(std::string tag) {
-  tags_ +=
-      std::to_string((float)(memoffset_) / 4 * T2_ / 1e6) + "," + tag + "\n";
-}
+void Acquirer::tagRecording(std::string tag) { recorder_.tag(tag); }
 
-void Acquirer::acquireData() {
+template <typename L> void Acquirer::acquireData() {
   use_buffer_  = BUFFER_A;
   proc_buffer_ = BUFFER_B;
 
   uint8_t ack0, ack0_prec;
-  char    dummytxbuf[BUF_LEN];
+  char    dummytxbuf[L::frame_len];
 
   while (running_) {
-    ack0_prec = bcm2835_gpio_lev(ACK0);
+    ack0_prec = bcm2835_gpio_lev(board_.cfg.ack0);
     if (iter_ == 0)
       ack0_prec = (ack0_prec == 0) ? 1 : 0;
 
     // assert REQ low, thus requesting data to the SPI port
-    bcm2835_gpio_write(REQ, LOW);
+    bcm2835_gpio_write(board_.cfg.req, LOW);
     // deassert REQ
-    bcm2835_gpio_write(REQ, HIGH);
+    bcm2835_gpio_write(board_.cfg.req, HIGH);
 
     // wait for the dsPic to acknowledge the SPI transfer
     do {
-      ack0 = bcm2835_gpio_lev(ACK0);
-    } while (ack0 == ack0_prec);
+      ack0 = bcm2835_gpio_lev(board_.cfg.ack0);
+    } while (ack0 == ack0_prec && running_);
+
+    const uint64_t t_ack{monotonicRawNs()};
 
     // bcm2835_gpio_write(TP3, HIGH);
 
     // cout << "ACQ: Pre-LOCK " << iter_ << endl;
     // Wait for the acquisition to start
     std::unique_lock<std::mutex> lock(dataMutex);
+    const bool                   idle{!(acquiring_ && running_)};
     // Use a condition variable to start the acquisition
-    acqCV.wait(lock, [this]() -> bool { return acquiring_ && running_; });
+    acqCV.wait(lock, [this]() -> bool { return acquiring_ || !running_; });
     // cout << "ACQ: LOCK " << iter_ << endl;
+    if (!running_)
+      break;
+
+    // The frame takes the next slot of the ring, even if it overwrites a
+    // frame that was not processed yet
+    const uint64_t seq{ring_.head()};
+
+    // Time the handshake, unless this edge predates a pause of the thread
+    if (idle)
+      cadence_.restart();
+    else
+      cadence_.mark(seq, t_ack);
 
     // Read data via SPI
     if (use_buffer_ == BUFFER_A) {
-      bcm2835_spi_transfernb(&dummytxbuf[0], &pingpong_A_[0], BUF_LEN);
+      spi_read_frame(board_, &dummytxbuf[0], &pingpong_A_[0], L::frame_len);
     } else {
-      bcm2835_spi_transfernb(&dummytxbuf[0], &pingpong_B_[0], BUF_LEN);
+      spi_read_frame(board_, &dummytxbuf[0], &pingpong_B_[0], L::frame_len);
     }
 
-    // Unlock the mutex
-    lock.unlock();
-    // cout << "ACQ: UNLOCK " << iter_ << endl;
+    // Time from the ACK0 edge to the end of the read
+    const uint64_t t_read{monotonicRawNs()};
+    const uint64_t service_ns{t_read - t_ack};
+    if (service_ns > max_service_ns_.load(std::memory_order_relaxed))
+      max_service_ns_.store(service_ns, std::memory_order_relaxed);
+
+    // The previous frame was not processed yet: it is overwritten
+    if (frame_ready_)
+      overruns_.store(overruns_.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+    acquired_.store(acquired_.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
 
     proc_buffer_ = (use_buffer_ == BUFFER_A) ? BUFFER_A : BUFFER_B;
     use_buffer_  = (use_buffer_ == BUFFER_A) ? BUFFER_B : BUFFER_A;
+    frame_ready_ = true;
+    ack_ns_      = t_ack;
+    read_ns_     = t_read;
+
+    // Unlock the mutex
+    lock.unlock();
+    // cout << "ACQ: UNLOCK " << iter_ << endl;
+    LOG_TRACE("Board {}: frame {} read {} ns after ACK0", board_.cfg.id, seq,
+              service_ns);
 
     // Notify the processing thread that the data is ready
     dataCV.notify_one();
@@ -208,37 +277,81 @@ void Acquirer::acquireData() {
   }
 }
 
-void Acquirer::processData(Server* server) {
+template <typename L> void Acquirer::processData(Server* server) {
   while (running_) {
     // Wait for the data to be ready
     // cout << "PROC: Pre-LOCK " << iter_ << endl;
     std::unique_lock<std::mutex> lock(dataMutex);
     // cout << "PROC: LOCK " << iter_ << endl;
-    dataCV.wait(lock);
+    dataCV.wait(lock, [this]() -> bool { return frame_ready_ || !running_; });
+    if (!running_)
+      break;
+    frame_ready_ = false;
 
     char* data{(proc_buffer_ == BUFFER_A) ? pingpong_A_ : pingpong_B_};
-    if (recording_ && !paused_) {
-      std::memcpy((char*)memblock_ + memoffset_, data, BUF_LEN);
+
+    // Closed-loop control first, it is the latency-critical path. The frame
+    // gets sequence number ring_.head() when it is pushed below
+    if (feedback_.active())
+      feedback_.update(data, ring_.head(), read_ns_);
+
+    // The recorder drains the ring from its own thread, the server
+    // retransmits from it
+    ring_.push(data);
+    const uint64_t seq{ring_.head() - 1};
+
+    // Wall-clock time of the ACK0 edge of the frame
+    const uint64_t time_ns{realtimeNs() - (monotonicRawNs() - ack_ns_)};
+
+    // Send the data to the server, as calibrated uA if asked
+    bool sent;
+    if (ua_stream_.load(std::memory_order_relaxed)) {
+      float ua[L::n_samples * L::n_channels];
+      board_.cal.toMicroamps(data, 1, info_, ua);
+      sent = server->sendData(board_.cfg.id, seq, time_ns,
+                              reinterpret_cast<const char*>(ua), sizeof(ua),
+                              DATA_FLAG_CALIBRATED);
+    } else {
+      sent = server->sendData(board_.cfg.id, seq, time_ns, data, L::frame_len);
     }
+    if (!sent)
+      send_failures_.store(send_failures_.load(std::memory_order_relaxed) + 1,
+                           std::memory_order_relaxed);
+    processed_.store(processed_.load(std::memory_order_relaxed) + 1,
+                     std::memory_order_relaxed);
 
-    // Send the data to the server
-    server->sendData(data);
+    // The spectrum thread drops frames rather than slow us down
+    if (spectrum_.enabled())
+      spectrum_.push(data);
+
+    // Local consumers read the shared-memory ring at their own pace
+    shm_.publish(seq, time_ns, data);
 
     // Unlock the mutex
     lock.unlock();
     // cout << "PROC: UNLOCK " << iter_ << endl;
-
-    if (recording_ && !paused_) {
-      memoffset_ =
-          (memoffset_ >= MEM_SIZE - BUF_LEN) ? 0 : memoffset_ + BUF_LEN;
-      // cout << "memoffset: " << memoffset_ << endl;
+    LOG_TRACE("Board {}: frame {} processed", board_.cfg.id, seq);
+
+    // Log the late handshakes in the recording
+    CadenceEvent ev;
+    while (cadence_.events.pop(ev)) {
+      LOG_DEBUG("Board {}: late ACK0 edge, frame {} after {} us",
+                board_.cfg.id, ev.frame, ev.interval_ns / 1000);
+      if (recording_ && !paused_)
+        recorder_.tag("gap " + std::to_string(ev.interval_ns / 1000) + " us",
+                      ev.frame);
     }
   }
 }
 
 int Acquirer::setT2(float value) {
   T2_ = value;
-  return set_T2(T2_);
+  cadence_.setNominal(info_.n_samples * T2_);
+  recorder_.setT2(T2_);
+  spectrum_.setT2(T2_);
+  shm_.setT2(T2_);
+  feedback_.setT2(T2_);
+  return set_T2(board_, T2_);
 }
 
 int Acquirer::setVG(double value, int channel) {
@@ -247,7 +360,10 @@ int Acquirer::setVG(double value, int channel) {
   ss << std::fixed << std::setprecision(2) << value;
   tagRecording(VG_LATEX(std::to_string(channel), ss.str()));
 
-  return set_VG(value, channel);
+  if (set_VG(board_, value, channel) == -1)
+    return -1;
+  feedback_.setManual(Feedback::Output::VG, channel, value);
+  return 0;
 }
 
 int Acquirer::setVsetpoint(double value, int channel) {
@@ -256,5 +372,8 @@ int Acquirer::setVsetpoint(double value, int channel) {
   ss << std::fixed << std::setprecision(2) << value;
   tagRecording(IDS_LATEX(std::to_string(channel), ss.str()));
 
-  return set_Vsetpoint(value, channel);
+  if (set_Vsetpoint(board_, value, channel) == -1)
+    return -1;
+  feedback_.setManual(Feedback::Output::Isetpoint, channel, value);
+  return 0;
 }
@@ -1,23 +1,42 @@
 #pragma once
 
+#include "cadence.hpp"
+#include "feedback.hpp"
+#include "frame_ring.hpp"
 #include "hw_peripherals.hpp"
+#include "recorder.hpp"
+#include "shm_publisher.hpp"
+#include "spectrum.hpp"
 
 #include <atomic>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdint>
 #include <mutex>
 #include <string>
 #include <string_view>
 #include <thread>
 #include <vector>
 
-#define MEM_SIZE 1024 * 1024 * 1024 // 1 GB
+#define HISTORY_SECONDS 60 // frames kept in the ring at the initial T2
 
 class Server;
 
+// Counters of the acquisition pipeline, since the threads started
+struct PipelineStats {
+  uint64_t acquired;       // frames read from the board
+  uint64_t processed;      // frames handed to the recorder and the network
+  uint64_t overruns;       // frames overwritten before being processed
+  uint64_t send_failures;  // frames the network did not accept
+  uint64_t gaps;           // late ACK0 edges (see CadenceMonitor)
+  uint64_t lost;           // frames the recorder could not write
+  uint64_t backlog;        // frames waiting for the recorder
+  uint64_t max_service_ns; // longest ACK0 edge to end of SPI read
+};
+
 class Acquirer {
 public:
-  Acquirer(std::string_view, float);
+  Acquirer(std::string_view, float, Board&);
   ~Acquirer();
 
   void                     startThreads(Server*);
@@ -29,21 +48,46 @@ public:
   void                     pauseRecording();
   void                     resumeRecording();
   std::vector<std::string> stopRecording();
-  std::vector<std::string> saveRecording();
   void                     tagRecording(std::string);
+  void                     setRotation(uint64_t, unsigned int);
+  float                    setPreroll(float);
+  std::string              snapshot(std::string_view);
+  float                    historySeconds() const;
+  size_t                   startSpectrum(size_t);
+  void                     stopSpectrum();
 
   int setT2(float);
   int setVG(double, int);
   int setVsetpoint(double, int);
 
-  bool             running_;
+  PipelineStats pipelineStats() const;
+  uint64_t      framesProduced() const { return ring_.head(); }
+  uint64_t      historyFrames() const { return ring_.capacity(); }
+  bool          copyFrames(uint64_t first, uint64_t n, char* out) const {
+    return ring_.copy(first, n, out);
+  }
+  void          resetServiceLatency() { max_service_ns_ = 0; }
+  void          setMicroampStream(bool on) { ua_stream_ = on; }
+  bool          microampStream() const { return ua_stream_; }
+
+  float            T2() const { return T2_; }
+  const FrameInfo& frameInfo() const { return info_; }
+  int              boardId() const { return board_.cfg.id; }
+  Board&           board() { return board_; }
+  uint64_t         lostFrames() const { return recorder_.lostFrames(); }
+  std::string      cadenceReport() const { return cadence_.report(); }
+  void             setGapFactor(double k) { cadence_.setGapFactor(k); }
+  bool             spectrumOn() const { return spectrum_.enabled(); }
+  Feedback&        feedback() { return feedback_; }
+
+  std::atomic_bool running_;
   std::atomic_bool acquiring_;
   std::atomic_bool recording_;
   std::atomic_bool paused_;
 
 private:
-  void acquireData();
-  void processData(Server*);
+  template <typename L> void acquireData();
+  template <typename L> void processData(Server*);
 
   std::mutex              dataMutex;
   std::condition_variable acqCV;
@@ -51,15 +95,34 @@ private:
 
   std::jthread  acqThread_;
   std::jthread  procThread_;
+  Server*       server_;
+  Board&        board_;
+  FrameInfo     info_;
   float         T2_;
   long int      iter_;
   unsigned char use_buffer_;
   unsigned char proc_buffer_;
-  char          pingpong_A_[BUF_LEN];
-  char          pingpong_B_[BUF_LEN];
-  void*         memblock_;
-  size_t        memoffset_;
-  std::string   filename_;
+  bool          frame_ready_;
+  uint64_t      ack_ns_;  // ACK0 edge of the frame ready to be processed
+  uint64_t      read_ns_; // end of its SPI read
+  char          pingpong_A_[MAX_BUF_LEN];
+  char          pingpong_B_[MAX_BUF_LEN];
   std::string   data_folder_;
-  std::string   tags_;
+  float         preroll_s_;
+
+  std::atomic_bool ua_stream_; // send calibrated uA instead of raw words
+
+  // Written by one thread each, read by anyone
+  std::atomic<uint64_t> acquired_;
+  std::atomic<uint64_t> processed_;
+  std::atomic<uint64_t> overruns_;
+  std::atomic<uint64_t> send_failures_;
+  std::atomic<uint64_t> max_service_ns_;
+
+  CadenceMonitor cadence_;
+  FrameRing      ring_;
+  Recorder       recorder_;
+  Spectrum       spectrum_;
+  ShmPublisher   shm_;
+  Feedback       feedback_;
 };
@@ -0,0 +1,450 @@
+/*
+ * ocmfet-analyze: noise spectrum and statistics of recordings.
+ *
+ * The .bin file is streamed with positional reads by a pool of workers, one
+ * chunk of whole Welch segments (plus the overlap with the next chunk) at a
+ * time, so that the memory use does not depend on the length of the
+ * recording. Each worker accumulates the periodograms and the statistics of
+ * the tag intervals it sees; the partial results are merged at the end.
+ */
+#include "fft.hpp"
+#include "frame_layout.hpp"
+#include "recording.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define ANALYZE_NFFT 4096                // default Welch segment length
+#define ANALYZE_CHUNK_SAMPLES (1 << 20) // samples read by a worker at a time
+
+struct Options {
+  size_t                      nfft{ANALYZE_NFFT};
+  double                      overlap{0.5};
+  unsigned int                threads{0};
+  std::optional<BoardVariant> variant;
+  float                       T2{0};
+  std::string                 out_dir;
+};
+
+static void usage(const char* name) {
+  std::cerr << "Usage: " << name << " [options] <recording.bin>..." << '\n'
+            << "  -n <points>            Welch segment length, a power of two "
+               "(default: "
+            << ANALYZE_NFFT << ")" << '\n'
+            << "  -v <fraction>          overlap of the segments (default: "
+               "0.5)"
+            << '\n'
+            << "  -j <threads>           worker threads (default: all cores)"
+            << '\n'
+            << "  -b feedback|nofeedback board variant, if there is no .meta"
+            << '\n'
+            << "  -T <us>                T2, if there is no .meta" << '\n'
+            << "  -o <dir>               output folder (default: next to the "
+               "recording)"
+            << '\n';
+}
+
+/*
+ * Running mean and variance of the samples and their covariance with time
+ * (for the drift), mergeable across workers.
+ */
+struct Moments {
+  double n{0};
+  double mean_t{0};
+  double mean_x{0};
+  double m2_t{0};
+  double m2_x{0};
+  double c_tx{0};
+
+  void add(double t, double x) {
+    n += 1;
+    const double dt{t - mean_t};
+    const double dx{x - mean_x};
+    mean_t += dt / n;
+    mean_x += dx / n;
+    m2_t += dt * (t - mean_t);
+    m2_x += dx * (x - mean_x);
+    c_tx += dt * (x - mean_x);
+  }
+
+  void merge(const Moments& o) {
+    if (o.n == 0)
+      return;
+    if (n == 0) {
+      *this = o;
+      return;
+    }
+
+    const double total{n + o.n};
+    const double dt{o.mean_t - mean_t};
+    const double dx{o.mean_x - mean_x};
+    const double w{n * o.n / total};
+    m2_t += o.m2_t + dt * dt * w;
+    m2_x += o.m2_x + dx * dx * w;
+    c_tx += o.c_tx + dt * dx * w;
+    mean_t += dt * o.n / total;
+    mean_x += dx * o.n / total;
+    n = total;
+  }
+
+  double rms() const { return (n > 0) ? std::sqrt(m2_x / n) : 0; }
+  double drift() const { return (m2_t > 0) ? c_tx / m2_t : 0; }
+};
+
+// Samples between two tags (or the start/end of the recording)
+struct Interval {
+  uint64_t    start;
+  uint64_t    end;
+  std::string tag;
+};
+
+static std::vector<Interval> tagIntervals(const std::vector<RecordingTag>& tags,
+                                          uint64_t n_samples) {
+  std::vector<Interval> intervals{{0, n_samples, "(start)"}};
+  for (const RecordingTag& tag : tags) {
+    const uint64_t at{std::min(tag.sample, n_samples)};
+    if (at == intervals.back().start) {
+      // Several tags at the same sample: keep them together
+      std::string& text{intervals.back().tag};
+      text = (text == "(start)") ? tag.text : text + "; " + tag.text;
+      continue;
+    }
+    intervals.back().end = at;
+    intervals.push_back(Interval{at, n_samples, tag.text});
+  }
+  return intervals;
+}
+
+// Results of the workers, merged under a mutex
+struct Analysis {
+  std::mutex                       mutex;
+  std::vector<std::vector<double>> psd;     // [channel][bin]
+  std::vector<Moments>             moments; // [interval * n_channels + ch]
+};
+
+template <typename L>
+static bool analyzeLayout(const RecordingFile& rec, const Options& opt,
+                          float T2, const BoardCalibration::Affine* cal,
+                          const std::vector<Interval>& intervals,
+                          Analysis& result, uint64_t& n_segments) {
+  constexpr size_t n_ch{L::n_channels};
+  const uint64_t   n_samples{rec.frames() * L::n_samples};
+  const size_t     nfft{opt.nfft};
+  const size_t     hop{std::max<size_t>(
+      1, static_cast<size_t>(std::lround((double)nfft * (1 - opt.overlap))))};
+
+  // A chunk holds whole segments, the last one may extend into the next chunk
+  const uint64_t segs_per_chunk{
+      std::max<uint64_t>(1, ANALYZE_CHUNK_SAMPLES / hop)};
+  const uint64_t chunk_samples{segs_per_chunk * hop};
+  const uint64_t n_chunks{(n_samples + chunk_samples - 1) / chunk_samples};
+  n_segments = (n_samples >= nfft) ? (n_samples - nfft) / hop + 1 : 0;
+
+  const FFT                 fft(nfft);
+  const std::vector<double> window{hannWindow(nfft)};
+
+  result.psd.assign(n_ch, std::vector<double>(nfft / 2 + 1, 0.0));
+  result.moments.assign(intervals.size() * n_ch, Moments{});
+
+  std::atomic<uint64_t> next{0};
+  std::atomic_bool      failed{false};
+
+  auto worker = [&](unsigned int) {
+    std::vector<char>                 bytes;
+    std::vector<uint16_t>             words;
+    std::vector<double>               x[n_ch];
+    std::vector<std::complex<double>> z(nfft);
+    std::vector<std::vector<double>>  psd(n_ch,
+                                          std::vector<double>(nfft / 2 + 1));
+    std::vector<Moments>              moments(intervals.size() * n_ch);
+
+    while (!failed) {
+      const uint64_t c{next++};
+      if (c >= n_chunks)
+        break;
+
+      // Samples owned by the chunk (statistics), samples read (segments)
+      const uint64_t own_start{c * chunk_samples};
+      const uint64_t own_end{std::min(n_samples, own_start + chunk_samples)};
+      const uint64_t seg_first{c * segs_per_chunk};
+      const uint64_t seg_last{std::min(n_segments, seg_first + segs_per_chunk)};
+      uint64_t       read_end{own_end};
+      if (seg_last > seg_first)
+        read_end = std::max(read_end, (seg_last - 1) * hop + nfft);
+
+      const uint64_t frame_first{own_start / L::n_samples};
+      const uint64_t frame_last{(read_end + L::n_samples - 1) / L::n_samples};
+      const uint64_t n_frames{frame_last - frame_first};
+      const uint64_t base{frame_first * L::n_samples};
+
+      bytes.resize(n_frames * L::frame_len);
+      words.resize(n_frames * L::n_samples * n_ch);
+      if (!rec.read(frame_first, n_frames, bytes.data())) {
+        failed = true;
+        break;
+      }
+      for (uint64_t f = 0; f < n_frames; f++)
+        decodeFrame<L>(&bytes[f * L::frame_len],
+                       &words[f * L::n_samples * n_ch]);
+      for (size_t ch = 0; ch < n_ch; ch++) {
+        x[ch].resize(n_frames * L::n_samples);
+        for (size_t i = 0; i < x[ch].size(); i++)
+          x[ch][i] = cal[ch].gain *
+                         mapADCVto_uA(mapRAWADCtoV(words[i * n_ch + ch])) +
+                     cal[ch].offset;
+      }
+
+      // Statistics of the owned samples, interval by interval
+      size_t iv{0};
+      while (intervals[iv].end <= own_start)
+        iv++;
+      for (uint64_t s = own_start; s < own_end; s++) {
+        while (s >= intervals[iv].end)
+          iv++;
+        const double t{(double)s * T2 / 1e6};
+        for (size_t ch = 0; ch < n_ch; ch++)
+          moments[iv * n_ch + ch].add(t, x[ch][s - base]);
+      }
+
+      // Periodograms, two real channels per complex transform
+      for (uint64_t k = seg_first; k < seg_last; k++) {
+        const size_t off{static_cast<size_t>(k * hop - base)};
+        for (size_t ch = 0; ch < n_ch; ch += 2) {
+          const bool pair{ch + 1 < n_ch};
+
+          // Remove the mean of the segment before windowing
+          double m0{0}, m1{0};
+          for (size_t i = 0; i < nfft; i++) {
+            m0 += x[ch][off + i];
+            if (pair)
+              m1 += x[ch + 1][off + i];
+          }
+          m0 /= (double)nfft;
+          m1 /= (double)nfft;
+
+          for (size_t i = 0; i < nfft; i++)
+            z[i] = {(x[ch][off + i] - m0) * window[i],
+                    pair ? (x[ch + 1][off + i] - m1) * window[i] : 0.0};
+          fft.transform(z.data());
+
+          // Split the spectra of the real and imaginary inputs
+          for (size_t b = 0; b <= nfft / 2; b++) {
+            const std::complex<double> zk{z[b]};
+            const std::complex<double> zn{std::conj(z[(nfft - b) % nfft])};
+            psd[ch][b] += std::norm(0.5 * (zk + zn));
+            if (pair)
+              psd[ch + 1][b] += std::norm(0.5 * (zk - zn));
+          }
+        }
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(result.mutex);
+    for (size_t ch = 0; ch < n_ch; ch++)
+      for (size_t b = 0; b <= nfft / 2; b++)
+        result.psd[ch][b] += psd[ch][b];
+    for (size_t i = 0; i < moments.size(); i++)
+      result.moments[i].merge(moments[i]);
+  };
+
+  {
+    std::vector<std::jthread> pool;
+    for (unsigned int t = 1; t < opt.threads; t++)
+      pool.emplace_back(worker, t);
+    worker(0u);
+  }
+
+  return !failed;
+}
+
+static std::string outputBase(const std::string& base, const Options& opt) {
+  if (opt.out_dir.empty())
+    return base;
+  const size_t slash{base.rfind('/')};
+  return opt.out_dir + "/" +
+         ((slash == std::string::npos) ? base : base.substr(slash + 1));
+}
+
+static bool analyze(const std::string& path, const Options& opt) {
+  const std::string base{recordingBase(path)};
+
+  RecordingMeta meta;
+  if (!readRecordingMeta(base, meta) && !opt.variant)
+    std::cerr << "No " << base << ".meta, assuming a " << meta.info.name
+              << " board with T2 = " << meta.T2 << " us" << '\n';
+  if (opt.variant)
+    meta.info = frameInfo(*opt.variant);
+  if (opt.T2 > 0)
+    meta.T2 = opt.T2;
+
+  RecordingFile rec(path, meta.info.frame_len);
+  if (!rec.ok())
+    return false;
+  if (rec.trailingBytes() > 0)
+    std::cerr << "Ignoring " << rec.trailingBytes()
+              << " bytes of an incomplete frame at the end of " << path << '\n';
+
+  const uint64_t n_samples{rec.frames() * meta.info.n_samples};
+  const size_t   n_ch{meta.info.n_channels};
+  const double   fs{1e6 / meta.T2};
+  const auto     intervals{
+      tagIntervals(readRecordingTags(base, meta.T2), n_samples)};
+
+  const auto t0{std::chrono::steady_clock::now()};
+
+  Analysis result;
+  uint64_t n_segments{0};
+  const bool ok{visitLayout(meta.info.variant, [&](auto l) {
+    return analyzeLayout<decltype(l)>(rec, opt, meta.T2, meta.cal, intervals,
+                                      result, n_segments);
+  })};
+  if (!ok) {
+    std::cerr << "Error reading " << path << '\n';
+    return false;
+  }
+
+  const double seconds{std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0)
+                           .count()};
+  std::cout << path << ": " << n_samples << " samples ("
+            << (double)n_samples / fs << " s), " << n_segments
+            << " segments analyzed in " << seconds << " s" << '\n';
+
+  const std::string out{outputBase(base, opt)};
+
+  // One-sided PSD in uA^2/Hz
+  if (n_segments > 0) {
+    double sum_w2{0};
+    for (double w : hannWindow(opt.nfft))
+      sum_w2 += w * w;
+    const double scale{1.0 / ((double)n_segments * fs * sum_w2)};
+    const double df{fs / (double)opt.nfft};
+
+    const std::string filename{out + "_psd.csv"};
+    FILE*             fp{fopen(filename.c_str(), "w")};
+    if (fp == NULL) {
+      std::cerr << "Error creating " << filename << '\n';
+      return false;
+    }
+
+    fprintf(fp, "freq_Hz");
+    for (size_t ch = 0; ch < n_ch; ch++)
+      fprintf(fp, ",ch%zu_uA2_Hz", ch + 1);
+    fprintf(fp, "\n");
+
+    std::vector<double> noise(n_ch, 0.0);
+    for (size_t b = 0; b <= opt.nfft / 2; b++) {
+      const double one_sided{(b == 0 || b == opt.nfft / 2) ? 1.0 : 2.0};
+      fprintf(fp, "%.6g", (double)b * df);
+      for (size_t ch = 0; ch < n_ch; ch++) {
+        const double p{result.psd[ch][b] * scale * one_sided};
+        noise[ch] += p * df;
+        fprintf(fp, ",%.6e", p);
+      }
+      fprintf(fp, "\n");
+    }
+    fclose(fp);
+
+    std::cout << "PSD saved to " << filename << " (" << df
+              << " Hz resolution)" << '\n';
+    for (size_t ch = 0; ch < n_ch; ch++)
+      std::cout << "  ch" << ch + 1 << ": " << std::sqrt(noise[ch])
+                << " uA rms noise up to " << fs / 2 << " Hz" << '\n';
+  } else {
+    std::cerr << "Recording shorter than one segment, no PSD" << '\n';
+  }
+
+  // Statistics of each tag interval
+  const std::string filename{out + "_stats.csv"};
+  FILE*             fp{fopen(filename.c_str(), "w")};
+  if (fp == NULL) {
+    std::cerr << "Error creating " << filename << '\n';
+    return false;
+  }
+
+  fprintf(fp, "interval,start_sample,n_samples,start_s");
+  for (size_t ch = 0; ch < n_ch; ch++)
+    fprintf(fp, ",ch%zu_mean_uA,ch%zu_rms_uA,ch%zu_drift_uA_s", ch + 1, ch + 1,
+            ch + 1);
+  fprintf(fp, ",tag\n");
+
+  for (size_t iv = 0; iv < intervals.size(); iv++) {
+    const Interval& interval{intervals[iv]};
+    fprintf(fp, "%zu,%llu,%llu,%.6f", iv,
+            static_cast<unsigned long long>(interval.start),
+            static_cast<unsigned long long>(interval.end - interval.start),
+            (double)interval.start / fs);
+    for (size_t ch = 0; ch < n_ch; ch++) {
+      const Moments& m{result.moments[iv * n_ch + ch]};
+      fprintf(fp, ",%.6f,%.6f,%.6e", m.mean_x, m.rms(), m.drift());
+    }
+    fprintf(fp, ",%s\n", interval.tag.c_str());
+  }
+  fclose(fp);
+
+  std::cout << "Statistics of " << intervals.size() << " intervals saved to "
+            << filename << '\n';
+
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  Options                  opt;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    const bool       has_value{i + 1 < argc};
+
+    if (arg == "-n" && has_value) {
+      opt.nfft = static_cast<size_t>(atol(argv[++i]));
+    } else if (arg == "-v" && has_value) {
+      opt.overlap = atof(argv[++i]);
+    } else if (arg == "-j" && has_value) {
+      opt.threads = static_cast<unsigned int>(atoi(argv[++i]));
+    } else if (arg == "-b" && has_value) {
+      opt.variant = parseBoardVariant(argv[++i]);
+      if (!opt.variant) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-T" && has_value) {
+      opt.T2 = static_cast<float>(atof(argv[++i]));
+    } else if (arg == "-o" && has_value) {
+      opt.out_dir = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-') {
+      files.emplace_back(arg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (files.empty() || !FFT::isPowerOfTwo(opt.nfft) || opt.nfft < 2 ||
+      opt.overlap < 0 || opt.overlap >= 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (opt.threads == 0)
+    opt.threads = std::max(1u, std::thread::hardware_concurrency());
+
+  int status{0};
+  for (const std::string& file : files)
+    if (!analyze(file, opt))
+      status = 1;
+
+  return status;
+}
@@ -0,0 +1,152 @@
+#include "board_calibration.hpp"
+#include "hw_peripherals.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+// Nominal output of a DAC code: V for VG, uA for the setpoint (2 uA/V)
+static double nominalDac(BoardCalibration::Dac d, int code) {
+  const double volts{code * (G * V_REF) / DAC_CODES};
+  return (d == BoardCalibration::Dac::VG) ? volts : volts / 0.5;
+}
+
+BoardCalibration::BoardCalibration() { build(); }
+
+bool BoardCalibration::load(const std::string& path) {
+  std::ifstream file(path);
+  if (!file) {
+    LOG_ERROR("Error opening the calibration file {}", path);
+    return false;
+  }
+
+  Affine      adc[BOARD_CAL_CHANNELS];
+  Affine      dac[2][BOARD_CAL_CHANNELS];
+  std::string line;
+  int         n{0};
+  while (std::getline(file, line)) {
+    n++;
+    line = line.substr(0, line.find('#'));
+    line.erase(std::remove_if(line.begin(), line.end(),
+                              [](unsigned char c) { return std::isspace(c); }),
+               line.end());
+    if (line.empty())
+      continue;
+
+    // <ch|vg|is><n>_<gain|offset>=<value>
+    const size_t eq{line.find('=')};
+    const size_t us{line.find('_')};
+    if (eq == std::string::npos || us == std::string::npos || us < 3 ||
+        us > eq) {
+      LOG_ERROR("{}:{}: invalid line", path, n);
+      return false;
+    }
+    const std::string kind{line.substr(0, 2)};
+    const std::string coeff{line.substr(us + 1, eq - us - 1)};
+    try {
+      const int    ch{std::stoi(line.substr(2, us - 2))};
+      const double value{std::stod(line.substr(eq + 1))};
+      if (ch < 1 || ch > BOARD_CAL_CHANNELS || !std::isfinite(value))
+        throw std::out_of_range("channel");
+
+      Affine* a{nullptr};
+      if (kind == "ch")
+        a = &adc[ch - 1];
+      else if (kind == "vg")
+        a = &dac[static_cast<int>(Dac::VG)][ch - 1];
+      else if (kind == "is")
+        a = &dac[static_cast<int>(Dac::Isetpoint)][ch - 1];
+
+      // A non-positive gain would make the DAC table decreasing
+      if (a != nullptr && coeff == "gain" && value > 0)
+        a->gain = value;
+      else if (a != nullptr && coeff == "offset")
+        a->offset = value;
+      else
+        throw std::invalid_argument("key");
+    } catch (const std::exception&) {
+      LOG_ERROR("{}:{}: invalid line", path, n);
+      return false;
+    }
+  }
+
+  std::copy(std::begin(adc), std::end(adc), std::begin(adc_));
+  for (int d = 0; d < 2; d++)
+    std::copy(std::begin(dac[d]), std::end(dac[d]), std::begin(dac_[d]));
+  path_ = path;
+  build();
+  return true;
+}
+
+void BoardCalibration::build() {
+  for (int ch = 0; ch < BOARD_CAL_CHANNELS; ch++) {
+    std::vector<float>& lut{adc_lut_[ch]};
+    lut.resize(65536);
+    for (size_t raw = 0; raw < lut.size(); raw++)
+      lut[raw] = static_cast<float>(
+          adc_[ch].gain * mapADCVto_uA(mapRAWADCtoV(raw)) + adc_[ch].offset);
+
+    for (int d = 0; d < 2; d++) {
+      std::vector<float>& out{dac_out_[d][ch]};
+      out.resize(DAC_CODES);
+      for (int code = 0; code < DAC_CODES; code++)
+        out[code] = static_cast<float>(
+            dac_[d][ch].gain * nominalDac(static_cast<Dac>(d), code) +
+            dac_[d][ch].offset);
+    }
+  }
+}
+
+void BoardCalibration::toMicroamps(const char* frames, size_t n_frames,
+                                   const FrameInfo& info, float* out) const {
+  const unsigned char* p{reinterpret_cast<const unsigned char*>(frames)};
+  const size_t         n_ch{info.n_channels};
+  const size_t         n{n_frames * info.n_samples * n_ch};
+  for (size_t i = 0; i < n; i += n_ch)
+    for (size_t ch = 0; ch < n_ch; ch++, p += 2)
+      out[i + ch] = adc_lut_[ch][(p[0] << 8) | p[1]];
+}
+
+uint16_t BoardCalibration::dacCode(Dac d, int ch, double value) const {
+  const std::vector<float>& out{dac_out_[static_cast<int>(d)][ch - 1]};
+
+  // First code at or above the value, or the one just below if closer
+  const auto it{std::lower_bound(out.begin(), out.end(), value)};
+  if (it == out.begin())
+    return 0;
+  if (it == out.end())
+    return DAC_CODES - 1;
+  const bool below{value - *(it - 1) < *it - value};
+  return static_cast<uint16_t>(it - out.begin() - (below ? 1 : 0));
+}
+
+std::string BoardCalibration::report() const {
+  std::stringstream ss;
+  ss << std::setprecision(6) << "Calibration "
+     << (loaded() ? path_ : std::string("nominal"));
+  for (int ch = 1; ch <= BOARD_CAL_CHANNELS; ch++) {
+    const Affine& a{adc(ch)};
+    const Affine& vg{dac(Dac::VG, ch)};
+    const Affine& is{dac(Dac::Isetpoint, ch)};
+    ss << "; ch" << ch << " gain " << a.gain << " offset " << a.offset
+       << " \u03BCA, VG gain " << vg.gain << " offset " << vg.offset
+       << " V, setpoint gain " << is.gain << " offset " << is.offset
+       << " \u03BCA";
+  }
+  return ss.str();
+}
+
+std::string BoardCalibration::meta() const {
+  // Enough digits to rebuild the same tables offline
+  std::stringstream ss;
+  ss << std::setprecision(17)
+     << "calibration=" << (loaded() ? path_ : std::string("none")) << "\n";
+  for (int ch = 1; ch <= BOARD_CAL_CHANNELS; ch++)
+    ss << "ch" << ch << "_gain=" << adc(ch).gain << "\nch" << ch
+       << "_offset=" << adc(ch).offset << "\n";
+  return ss.str();
+}
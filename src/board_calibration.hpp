@@ -0,0 +1,73 @@
+#pragma once
+
+#include "frame_layout.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define BOARD_CAL_FOLDER   "/home/pi/calibration/" // board<id>.cal
+#define BOARD_CAL_CHANNELS 2
+#define DAC_CODES          4096
+
+// A calibrated frame: one float32 (uA) per 16-bit ADC word
+#define MAX_UA_FRAME_LEN (MAX_BUF_LEN / 2 * sizeof(float))
+
+/*
+ * Per-board calibration of the ADC channels and of the DAC outputs, read at
+ * startup from a text file of key=value lines (# starts a comment):
+ *
+ *   ch<n>_gain, ch<n>_offset  Ids = gain * nominal Ids + offset (uA)
+ *   vg<n>_gain, vg<n>_offset  VG = gain * nominal VG + offset (V)
+ *   is<n>_gain, is<n>_offset  setpoint = gain * nominal + offset (uA)
+ *
+ * where the nominal values are those of the fixed mappings of the hardware
+ * (mapRAWADCtoV, mapADCVto_uA, mapVtoDAC). The missing keys keep gain 1 and
+ * offset 0. The coefficients are compiled into tables: 65536 uA values per
+ * ADC channel, so that a sample costs one lookup, and the output of each of
+ * the 4096 codes of each DAC output, searched for the code closest to a
+ * requested value. The tables never change after loading and are shared
+ * without locks.
+ */
+class BoardCalibration {
+public:
+  enum class Dac { VG, Isetpoint };
+
+  struct Affine {
+    double gain{1};
+    double offset{0};
+  };
+
+  BoardCalibration();
+
+  bool load(const std::string&); // false if unreadable or invalid
+
+  bool               loaded() const { return !path_.empty(); }
+  const std::string& path() const { return path_; }
+  const Affine&      adc(int ch) const { return adc_[ch - 1]; }
+  const Affine&      dac(Dac d, int ch) const {
+    return dac_[static_cast<int>(d)][ch - 1];
+  }
+
+  // Calibrated Ids (uA) of a raw ADC word of channel ch (1-based)
+  float uA(int ch, uint16_t raw) const { return adc_lut_[ch - 1][raw]; }
+
+  // Convert whole frames to float32 uA, in the order of the ADC words
+  void toMicroamps(const char*, size_t, const FrameInfo&, float*) const;
+
+  // DAC code whose calibrated output is closest to value (V or uA)
+  uint16_t dacCode(Dac, int, double) const;
+
+  std::string report() const;
+  std::string meta() const; // key=value lines for the .meta files
+
+private:
+  void build();
+
+  std::string        path_; // empty: nominal mappings
+  Affine             adc_[BOARD_CAL_CHANNELS];
+  Affine             dac_[2][BOARD_CAL_CHANNELS];
+  std::vector<float> adc_lut_[BOARD_CAL_CHANNELS];
+  std::vector<float> dac_out_[2][BOARD_CAL_CHANNELS]; // increasing
+};
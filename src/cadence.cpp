@@ -0,0 +1,76 @@
+#include "cadence.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+CadenceMonitor::CadenceMonitor()
+    : last_ns_(0), gap_factor_(CADENCE_GAP_FACTOR), nominal_ns_(0),
+      gap_ns_(UINT64_MAX) {
+  reset();
+}
+
+void CadenceMonitor::reset() {
+  count_    = 0;
+  gaps_     = 0;
+  min_ns_   = UINT64_MAX;
+  max_ns_   = 0;
+  sum_ns_   = 0;
+  sumsq_ns_ = 0;
+  for (auto& h : hist_)
+    h = 0;
+}
+
+void CadenceMonitor::setNominal(double frame_period_us) {
+  nominal_ns_ = static_cast<uint64_t>(frame_period_us * 1e3);
+  gap_ns_     = static_cast<uint64_t>(frame_period_us * 1e3 * gap_factor_);
+}
+
+void CadenceMonitor::setGapFactor(double k) {
+  gap_factor_ = k;
+  gap_ns_     = static_cast<uint64_t>((double)nominal_ns_ * gap_factor_);
+}
+
+std::string CadenceMonitor::report() const {
+  const uint64_t n{count_};
+  if (n == 0)
+    return "Cadence: no frame intervals measured.";
+
+  const double nominal_us{(double)nominal_ns_ / 1e3};
+  const double mean_us{sum_ns_ / (double)n / 1e3};
+  const double var_us{sumsq_ns_ / (double)n / 1e6 - mean_us * mean_us};
+  const double min_us{(double)min_ns_ / 1e3};
+  const double max_us{(double)max_ns_ / 1e3};
+
+  // Percentiles from the histogram (upper edge of the bin)
+  auto percentile = [&](double p) -> std::string {
+    uint64_t target{(uint64_t)std::ceil(p * (double)n)};
+    uint64_t acc{0};
+    for (int i = 0; i < CADENCE_N_BINS; i++) {
+      acc += hist_[i];
+      if (acc >= target) {
+        std::stringstream ss;
+        ss << "<" << std::fixed << std::setprecision(1)
+           << nominal_us * (i + 1) / CADENCE_BIN_DIV;
+        return ss.str();
+      }
+    }
+    std::string top{">"};
+    top += std::to_string(
+        (int)(nominal_us * CADENCE_N_BINS / CADENCE_BIN_DIV));
+    return top;
+  };
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1);
+  ss << "Cadence: " << n << " intervals, nominal " << nominal_us
+     << " us, mean " << mean_us << " us, std "
+     << std::sqrt(std::max(var_us, 0.0)) << " us, min " << min_us
+     << " us, max " << max_us << " us, p50 " << percentile(0.5)
+     << " us, p99 " << percentile(0.99) << " us, p99.9 "
+     << percentile(0.999) << " us, worst jitter "
+     << std::max(max_us - nominal_us, nominal_us - min_us) << " us, "
+     << (uint64_t)gaps_ << " gaps > " << gap_factor_ << "x";
+  return ss.str();
+}
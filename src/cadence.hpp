@@ -0,0 +1,103 @@
+#pragma once
+
+#include "spsc_queue.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <time.h>
+
+#define CADENCE_GAP_FACTOR 2.0 // flag intervals longer than k frame periods
+#define CADENCE_BIN_DIV    8   // histogram bins per nominal frame period
+#define CADENCE_N_BINS     32  // histogram range: 0 to 4 frame periods
+
+// Timestamp used for the REQ/ACK handshakes (vDSO call, no syscall)
+inline uint64_t monotonicRawNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Wall-clock time, to timestamp the frames for the clients
+inline uint64_t realtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+struct CadenceEvent {
+  uint64_t frame;       // ring sequence number of the late frame
+  uint64_t interval_ns; // time since the previous frame
+};
+
+/*
+ * Online statistics of the interval between consecutive ACK0 edges, compared
+ * to the nominal frame period (n_samples * T2). mark() is called by the
+ * acquisition thread only; the other methods can be called from any thread.
+ */
+class CadenceMonitor {
+public:
+  CadenceMonitor();
+
+  void reset();
+  void setNominal(double frame_period_us);
+  void setGapFactor(double);
+  std::string report() const;
+
+  uint64_t gaps() const { return gaps_.load(std::memory_order_relaxed); }
+
+  // Forget the previous edge (the acquisition was idle in between)
+  void restart() { last_ns_ = 0; }
+
+  void mark(uint64_t frame, uint64_t t_ns) {
+    const uint64_t last{last_ns_};
+    last_ns_ = t_ns;
+    if (last == 0)
+      return;
+
+    const uint64_t dt{t_ns - last};
+    const uint64_t nominal{nominal_ns_.load(std::memory_order_relaxed)};
+
+    bump(count_, 1);
+    sum_ns_.store(sum_ns_.load(std::memory_order_relaxed) + (double)dt,
+                  std::memory_order_relaxed);
+    sumsq_ns_.store(sumsq_ns_.load(std::memory_order_relaxed) +
+                        (double)dt * (double)dt,
+                    std::memory_order_relaxed);
+    if (dt < min_ns_.load(std::memory_order_relaxed))
+      min_ns_.store(dt, std::memory_order_relaxed);
+    if (dt > max_ns_.load(std::memory_order_relaxed))
+      max_ns_.store(dt, std::memory_order_relaxed);
+
+    uint64_t bin{nominal ? dt * CADENCE_BIN_DIV / nominal : CADENCE_N_BINS};
+    bump(hist_[bin < CADENCE_N_BINS ? bin : CADENCE_N_BINS], 1);
+
+    if (dt > gap_ns_.load(std::memory_order_relaxed)) {
+      bump(gaps_, 1);
+      events.push(CadenceEvent{frame, dt});
+    }
+  }
+
+  // Gap events, drained by the processing thread
+  SpscQueue<CadenceEvent, 64> events;
+
+private:
+  // Single writer: a relaxed load/store pair is enough and avoids atomic RMW
+  static void bump(std::atomic<uint64_t>& c, uint64_t v) {
+    c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+  }
+
+  uint64_t              last_ns_;
+  double                gap_factor_;
+  std::atomic<uint64_t> nominal_ns_;
+  std::atomic<uint64_t> gap_ns_;
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> gaps_;
+  std::atomic<uint64_t> min_ns_;
+  std::atomic<uint64_t> max_ns_;
+  std::atomic<double>   sum_ns_;
+  std::atomic<double>   sumsq_ns_;
+  std::atomic<uint64_t> hist_[CADENCE_N_BINS + 1];
+};
@@ -0,0 +1,170 @@
+#include "calibration.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#define CAL_MAX_BACKLOG_MS 500 // recorder backlog tolerated while measuring
+
+// Counters can restart (new acquisition or recording) during a step
+static uint64_t delta(uint64_t from, uint64_t to) {
+  return (to >= from) ? to - from : to;
+}
+
+Calibration::Calibration(Acquirer& acq, const Settings& settings, Report report)
+    : acq_(acq), settings_(settings), report_(std::move(report)),
+      state_(State::Settling), initial_T2_(acq.T2()),
+      was_acquiring_(acq.acquiring_), T2_(0), best_T2_(0), start_{},
+      max_backlog_(0) {
+  if (settings_.from <= 0)
+    settings_.from = initial_T2_;
+
+  std::stringstream ss;
+  ss << "Calibrating T2 from " << settings_.from << " to " << settings_.to
+     << " \u03BCs in steps of " << settings_.step << " \u03BCs, "
+     << settings_.frames << " frames per step...";
+  report_(ss.str());
+
+  if (!was_acquiring_)
+    acq_.start();
+  startStep(settings_.from);
+}
+
+void Calibration::startStep(float T2) {
+  T2_ = T2;
+  if (acq_.setT2(T2_) == -1) {
+    std::stringstream ss;
+    ss << "Error setting T2 to " << T2_ << " \u03BCs.";
+    report_(ss.str());
+    finish();
+    return;
+  }
+
+  state_      = State::Settling;
+  start_      = acq_.pipelineStats();
+  step_start_ = std::chrono::steady_clock::now();
+}
+
+bool Calibration::update() {
+  if (state_ == State::Done)
+    return true;
+
+  const PipelineStats stats{acq_.pipelineStats()};
+  const uint64_t      frames{delta(start_.acquired, stats.acquired)};
+  const double        frame_us{acq_.frameInfo().n_samples * T2_};
+
+  // Give up on a step if the frames do not come (twice the expected time)
+  const uint64_t expected{(state_ == State::Settling) ? CAL_SETTLE_FRAMES
+                                                      : settings_.frames};
+  const auto     timeout{
+      std::chrono::microseconds(static_cast<int64_t>(expected * frame_us * 2)) +
+      std::chrono::seconds(1)};
+  const bool timed_out{std::chrono::steady_clock::now() - step_start_ >
+                       timeout};
+
+  if (state_ == State::Settling) {
+    if (frames >= CAL_SETTLE_FRAMES) {
+      acq_.resetServiceLatency();
+      start_       = acq_.pipelineStats();
+      max_backlog_ = 0;
+      step_start_  = std::chrono::steady_clock::now();
+      state_       = State::Measuring;
+    } else if (timed_out) {
+      std::stringstream ss;
+      ss << "T2 " << T2_ << " \u03BCs: no frames from the board.";
+      report_(ss.str());
+      finish();
+    }
+    return state_ == State::Done;
+  }
+
+  max_backlog_ = std::max(max_backlog_, stats.backlog);
+  if (frames < settings_.frames && !timed_out)
+    return false;
+
+  if (!evaluate()) {
+    finish();
+    return true;
+  }
+
+  best_T2_ = T2_;
+  const float next{T2_ - settings_.step};
+  if (settings_.step <= 0 || next < settings_.to - 1e-3f)
+    finish();
+  else
+    startStep(next);
+
+  return state_ == State::Done;
+}
+
+bool Calibration::evaluate() {
+  const PipelineStats stats{acq_.pipelineStats()};
+  const double        frame_us{acq_.frameInfo().n_samples * T2_};
+  const uint64_t      frames{delta(start_.acquired, stats.acquired)};
+  const uint64_t      overruns{delta(start_.overruns, stats.overruns)};
+  const uint64_t      gaps{delta(start_.gaps, stats.gaps)};
+  const uint64_t      failures{
+      delta(start_.send_failures, stats.send_failures)};
+  const uint64_t lost{delta(start_.lost, stats.lost)};
+  const double   service_us{stats.max_service_ns / 1e3};
+  const double   backlog_ms{max_backlog_ * frame_us / 1e3};
+
+  const bool lossless{frames >= settings_.frames && overruns == 0 &&
+                      gaps == 0 && failures == 0 && lost == 0 &&
+                      service_us < frame_us &&
+                      backlog_ms < CAL_MAX_BACKLOG_MS};
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1) << "T2 " << T2_ << " \u03BCs: "
+     << frames << " frames, service max " << service_us << " \u03BCs ("
+     << 100 * service_us / frame_us << "% of the frame), " << overruns
+     << " overruns, " << gaps << " gaps, " << failures << " send failures, "
+     << lost << " lost, recorder backlog max " << backlog_ms << " ms -> "
+     << (lossless ? "OK" : "FAIL");
+  report_(ss.str());
+
+  return lossless;
+}
+
+void Calibration::finish() {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(1);
+
+  float final_T2{initial_T2_};
+  if (best_T2_ > 0) {
+    // Round up to 0.1 us
+    const float recommended{
+        std::ceil(best_T2_ * (1 + settings_.margin / 100) * 10) / 10};
+    ss << "Minimum lossless T2: " << best_T2_ << " \u03BCs, recommended "
+       << recommended << " \u03BCs (+" << settings_.margin << "%). ";
+    if (settings_.apply)
+      final_T2 = recommended;
+  } else {
+    ss << "No lossless T2 found from " << settings_.from << " \u03BCs. ";
+  }
+
+  if (acq_.setT2(final_T2) == -1)
+    ss << "Error setting T2 to " << final_T2 << " \u03BCs!";
+  else
+    ss << "T2 set to " << final_T2 << " \u03BCs!";
+  report_(ss.str());
+
+  if (!was_acquiring_)
+    acq_.stop();
+  state_ = State::Done;
+}
+
+void Calibration::abort() {
+  if (state_ == State::Done)
+    return;
+
+  acq_.setT2(initial_T2_);
+  if (!was_acquiring_)
+    acq_.stop();
+  state_ = State::Done;
+
+  std::stringstream ss;
+  ss << "Calibration aborted, T2 restored to " << initial_T2_ << " \u03BCs.";
+  report_(ss.str());
+}
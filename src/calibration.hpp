@@ -0,0 +1,65 @@
+#pragma once
+
+#include "acquirer.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+#define CAL_MIN_T2_US     10    // default lowest T2 tried
+#define CAL_STEP_US       2     // default T2 decrement
+#define CAL_FRAMES        10000 // default frames measured per step
+#define CAL_MARGIN        10    // default safety margin (%)
+#define CAL_SETTLE_FRAMES 200   // frames skipped after each T2 change
+#define CAL_POLL_MS       50    // period of update()
+
+/*
+ * Search for the smallest T2 the whole pipeline sustains: starting from a
+ * safe value, T2 is lowered step by step while acquiring, and at each step
+ * the ACK0 service latency, the overruns, the late ACK0 edges, the send
+ * failures and the recorder backlog/losses are measured over a fixed number
+ * of frames. The search stops at the first step that is not lossless.
+ *
+ * update() is called periodically by the server event loop, so that the T2
+ * commands go through the same thread as all the other dsPIC commands.
+ */
+class Calibration {
+public:
+  struct Settings {
+    float    from{0}; // 0: the current T2
+    float    to{CAL_MIN_T2_US};
+    float    step{CAL_STEP_US};
+    uint64_t frames{CAL_FRAMES};
+    float    margin{CAL_MARGIN}; // %
+    bool     apply{false};
+  };
+
+  using Report = std::function<void(std::string_view)>;
+
+  Calibration(Acquirer&, const Settings&, Report);
+
+  bool update(); // true when the calibration is over
+  void abort();
+
+private:
+  enum class State { Settling, Measuring, Done };
+
+  void startStep(float);
+  bool evaluate(); // true if the step was lossless
+  void finish();
+
+  Acquirer&     acq_;
+  Settings      settings_;
+  Report        report_;
+  State         state_;
+  float         initial_T2_;
+  bool          was_acquiring_;
+  float         T2_;
+  float         best_T2_; // 0: no lossless step yet
+  PipelineStats start_;
+  uint64_t      max_backlog_;
+
+  std::chrono::steady_clock::time_point step_start_;
+};
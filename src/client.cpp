@@ -0,0 +1,627 @@
+/*
+ * ocmfet-client: end-to-end test of the data stream.
+ *
+ * Drives a server with the usual commands (sT2, start, stop, kill), receives
+ * the data datagrams on port + 1 (or from a multicast group) and measures
+ * what a client actually gets: lost, reordered and duplicated frames, the
+ * inter-arrival jitter (RFC 3550, from the acquisition timestamps of the
+ * DataHeader) and the latency from the ACK0 edge to the kernel receive
+ * timestamp. The latency is only meaningful if the clocks of the two
+ * machines are synchronized (or on the Pi itself).
+ *
+ * With --replay, a local thread plays a recording at the T2 rate instead of
+ * a server, which tests the client side and the network stack alone.
+ */
+#include "data_protocol.hpp"
+#include "frame_layout.hpp"
+#include "recording.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <optional>
+#include <poll.h>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#define CLIENT_DURATION_S  10      // default length of a run
+#define CLIENT_RCVBUF      8 << 20 // socket receive buffer (bytes)
+#define CLIENT_MAX_MISSING 65536   // missing frames tracked for reordering
+#define CLIENT_SETTLE_MS   500     // wait after the commands of a run
+
+struct Options {
+  std::string        host;
+  uint16_t           port{0};
+  uint16_t           data_port{0}; // 0: port + 1
+  std::string        group;        // multicast group to join
+  std::optional<int> board;        // @<id> prefix of the commands
+  double             duration{CLIENT_DURATION_S};
+  float              T2{0};        // 0: leave the T2 of the server
+  float              sweep_from{0};
+  float              sweep_to{0};
+  float              sweep_step{0};
+  double             max_loss{-1}; // % of frames, -1: no limit
+  bool               kill{false};
+  std::string        replay;
+  std::string        csv;
+};
+
+static void usage(const char* name) {
+  std::cerr
+      << "Usage: " << name << " [options] <server> <port>" << '\n'
+      << "       " << name << " [options] --replay <recording.bin> <port>"
+      << '\n'
+      << "  -d <s>                 length of each run (default: "
+      << CLIENT_DURATION_S << ")" << '\n'
+      << "  -T <us>                set T2 before starting" << '\n'
+      << "  -s <from>:<to>:<step>  sweep T2, one run per value" << '\n'
+      << "  -b <id>                board the commands are sent to" << '\n'
+      << "  -m <group>             join a multicast group for the data"
+      << '\n'
+      << "  -p <port>              data port (default: port + 1)" << '\n'
+      << "  -L <%>                 exit with 1 if a run loses more frames"
+      << '\n'
+      << "  -k                     send kill at the end" << '\n'
+      << "  -o <file.csv>          append the summary of each run to a file"
+      << '\n';
+}
+
+static uint64_t realtimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull +
+         static_cast<uint64_t>(ts.tv_nsec);
+}
+
+/*
+ * Statistics of the stream of one board. Frames are expected in sequence:
+ * a jump forward marks the skipped frames missing, a frame behind the
+ * expected one is either a missing frame arriving late (reordered) or a
+ * duplicate.
+ */
+class StreamStats {
+public:
+  void add(const DataHeader& h, uint64_t arrival_ns) {
+    if (h.flags & DATA_FLAG_RETRANSMIT) {
+      retransmitted_ += h.n_frames;
+      return;
+    }
+
+    for (uint64_t seq = h.seq; seq < h.seq + h.n_frames; seq++)
+      addFrame(seq);
+    datagrams_++;
+
+    // Latency from the ACK0 edge
+    if (h.time_ns > 0 && arrival_ns >= h.time_ns)
+      latencies_us_.push_back(
+          static_cast<uint32_t>((arrival_ns - h.time_ns) / 1000));
+
+    // RFC 3550 interarrival jitter, in the acquisition time base
+    if (last_arrival_ns_ > 0 && h.time_ns > 0) {
+      const double d{(double)(int64_t)(arrival_ns - last_arrival_ns_) -
+                     (double)(int64_t)(h.time_ns - last_time_ns_)};
+      jitter_ns_ += (std::fabs(d) - jitter_ns_) / 16;
+      max_jitter_ns_ = std::max(max_jitter_ns_, jitter_ns_);
+      const double gap{(double)(arrival_ns - last_arrival_ns_)};
+      max_gap_ns_    = std::max(max_gap_ns_, gap);
+    }
+    last_arrival_ns_ = arrival_ns;
+    last_time_ns_    = h.time_ns;
+  }
+
+  uint64_t received() const { return received_; }
+  uint64_t lost() const { return missing_set_.size() + untracked_; }
+  uint64_t expected() const { return started_ ? next_ - first_ : 0; }
+  uint64_t reordered() const { return reordered_; }
+  uint64_t duplicates() const { return duplicates_; }
+  uint64_t retransmitted() const { return retransmitted_; }
+  double   jitterUs() const { return jitter_ns_ / 1e3; }
+  double   maxJitterUs() const { return max_jitter_ns_ / 1e3; }
+  double   maxGapMs() const { return max_gap_ns_ / 1e6; }
+
+  // Percentile of the latency (us), -1 without timestamps
+  double latencyUs(double p) {
+    if (latencies_us_.empty())
+      return -1;
+    const size_t k{std::min(latencies_us_.size() - 1,
+                            static_cast<size_t>(p * latencies_us_.size()))};
+    std::nth_element(latencies_us_.begin(), latencies_us_.begin() + k,
+                     latencies_us_.end());
+    return latencies_us_[k];
+  }
+
+private:
+  void addFrame(uint64_t seq) {
+    received_++;
+    if (!started_) {
+      started_ = true;
+      first_   = seq;
+      next_    = seq + 1;
+      return;
+    }
+
+    if (seq >= next_) {
+      // Frames skipped: missing until they show up
+      for (uint64_t s = next_; s < seq; s++) {
+        if (missing_set_.size() < CLIENT_MAX_MISSING)
+          missing_set_.insert(s);
+        else
+          untracked_++;
+      }
+      next_ = seq + 1;
+    } else if (missing_set_.erase(seq) > 0) {
+      reordered_++;
+    } else {
+      duplicates_++;
+      received_--;
+    }
+  }
+
+  bool                         started_{false};
+  uint64_t                     first_{0};
+  uint64_t                     next_{0};
+  uint64_t                     received_{0};
+  uint64_t                     datagrams_{0};
+  uint64_t                     untracked_{0}; // missing, not tracked
+  uint64_t                     reordered_{0};
+  uint64_t                     duplicates_{0};
+  uint64_t                     retransmitted_{0};
+  std::unordered_set<uint64_t> missing_set_;
+  std::vector<uint32_t>        latencies_us_;
+  uint64_t                     last_arrival_ns_{0};
+  uint64_t                     last_time_ns_{0};
+  double                       jitter_ns_{0};
+  double                       max_jitter_ns_{0};
+  double                       max_gap_ns_{0};
+};
+
+class CommandSocket {
+public:
+  CommandSocket(const Options& opt) : fd_(-1), board_(opt.board) {
+    if (opt.host.empty())
+      return;
+
+    struct addrinfo hints {};
+    struct addrinfo* res{nullptr};
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(opt.host.c_str(), std::to_string(opt.port).c_str(), &hints,
+                    &res) != 0 ||
+        res == nullptr) {
+      std::cerr << "Unknown server " << opt.host << '\n';
+      return;
+    }
+    std::memcpy(&server_, res->ai_addr, sizeof(server_));
+    freeaddrinfo(res);
+
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+  }
+
+  ~CommandSocket() {
+    if (fd_ != -1)
+      close(fd_);
+  }
+
+  bool ok() const { return fd_ != -1; }
+
+  void send(const std::string& command) {
+    if (fd_ == -1)
+      return;
+    const std::string message{board_ ? "@" + std::to_string(*board_) + " " +
+                                           command
+                                     : command};
+    std::cout << "> " << message << '\n';
+    sendto(fd_, message.data(), message.size(), 0,
+           (struct sockaddr*)&server_, sizeof(server_));
+  }
+
+  // Print the replies received so far
+  void printReplies() {
+    if (fd_ == -1)
+      return;
+    char buf[2048];
+    ssize_t n;
+    while ((n = recv(fd_, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+      std::cout << "< " << std::string_view(buf, static_cast<size_t>(n))
+                << '\n';
+  }
+
+private:
+  int                fd_;
+  std::optional<int> board_;
+  struct sockaddr_in server_ {};
+};
+
+static int openDataSocket(const Options& opt, uint16_t port) {
+  const int fd{socket(AF_INET, SOCK_DGRAM, 0)};
+  if (fd == -1)
+    return -1;
+
+  // Kernel receive timestamps, and room for the bursts
+  const int on{1}, rcvbuf{CLIENT_RCVBUF};
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct sockaddr_in address {};
+  address.sin_family      = AF_INET;
+  address.sin_addr.s_addr = INADDR_ANY;
+  address.sin_port        = htons(port);
+  if (bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+    std::cerr << "Error binding to port " << port << '\n';
+    close(fd);
+    return -1;
+  }
+
+  if (!opt.group.empty()) {
+    struct ip_mreq mreq {};
+    if (inet_pton(AF_INET, opt.group.c_str(), &mreq.imr_multiaddr) != 1 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) ==
+            -1) {
+      std::cerr << "Error joining the multicast group " << opt.group << '\n';
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+// Receive one datagram, with its kernel timestamp; false if none arrived
+static bool receive(int fd, char* buf, size_t len, ssize_t& n,
+                    uint64_t& arrival_ns) {
+  struct iovec  iov {buf, len};
+  char          control[64];
+  struct msghdr msg {};
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  n = recvmsg(fd, &msg, MSG_DONTWAIT);
+  if (n <= 0)
+    return false;
+
+  arrival_ns = 0;
+  for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != nullptr;
+       c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_TIMESTAMPNS) {
+      struct timespec ts;
+      std::memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+      arrival_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull +
+                   static_cast<uint64_t>(ts.tv_nsec);
+    }
+  }
+  if (arrival_ns == 0)
+    arrival_ns = realtimeNs();
+  return true;
+}
+
+/*
+ * Simulated source: send the frames of a recording to localhost at the T2
+ * rate, sequenced and timestamped like the server does.
+ */
+static void replay(const Options& opt, uint16_t port, float T2,
+                   std::stop_token st) {
+  RecordingMeta     meta;
+  const std::string base{recordingBase(opt.replay)};
+  readRecordingMeta(base, meta);
+  RecordingFile file(base + ".bin", meta.info.frame_len);
+  if (!file.ok() || file.frames() == 0) {
+    std::cerr << "Error opening " << opt.replay << '\n';
+    return;
+  }
+
+  const int          fd{socket(AF_INET, SOCK_DGRAM, 0)};
+  struct sockaddr_in to {};
+  to.sin_family      = AF_INET;
+  to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  to.sin_port        = htons(port);
+
+  using namespace std::chrono;
+  const double   frame_ns{meta.info.n_samples * T2 * 1e3};
+  const auto     start{steady_clock::now()};
+  const uint64_t start_ns{realtimeNs()};
+  char           datagram[sizeof(DataHeader) + MAX_BUF_LEN];
+  uint64_t       seq{0};
+
+  while (!st.stop_requested()) {
+    // Send the frames that are due, then sleep until the next one
+    const uint64_t due{static_cast<uint64_t>(
+        duration_cast<nanoseconds>(steady_clock::now() - start).count() /
+        frame_ns)};
+    for (; seq <= due; seq++) {
+      const uint64_t time_ns{start_ns +
+                             static_cast<uint64_t>(seq * frame_ns)};
+      DataHeader     header{DATA_MAGIC,
+                        DATA_VERSION,
+                        0,
+                        static_cast<uint8_t>(opt.board.value_or(0)),
+                        1,
+                        static_cast<uint16_t>(meta.info.frame_len),
+                        seq,
+                        time_ns};
+      std::memcpy(datagram, &header, sizeof(header));
+      file.read(seq % file.frames(), 1, datagram + sizeof(header));
+      sendto(fd, datagram, sizeof(header) + meta.info.frame_len, 0,
+             (struct sockaddr*)&to, sizeof(to));
+    }
+    std::this_thread::sleep_until(
+        start + nanoseconds(static_cast<int64_t>(seq * frame_ns)));
+  }
+  close(fd);
+}
+
+struct RunResult {
+  float    T2;
+  uint64_t received;
+  uint64_t expected;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t duplicates;
+  double   jitter_us;
+  double   max_jitter_us;
+  double   max_gap_ms;
+  double   latency_p50_us;
+  double   latency_p99_us;
+  double   latency_max_us;
+};
+
+static RunResult run(const Options& opt, CommandSocket& cmd, int fd,
+                     uint16_t data_port, float T2) {
+  using namespace std::chrono;
+
+  std::map<int, StreamStats> streams;
+  char                       buf[65536];
+
+  // Forget the datagrams of the previous run
+  ssize_t  n;
+  uint64_t arrival_ns;
+  while (receive(fd, buf, sizeof(buf), n, arrival_ns))
+    ;
+
+  std::optional<std::jthread> source;
+  if (!opt.replay.empty()) {
+    source.emplace([&opt, data_port, T2](std::stop_token st) {
+      replay(opt, data_port, T2, st);
+    });
+  } else {
+    if (T2 > 0) {
+      std::ostringstream ss;
+      ss << "sT2 " << T2;
+      cmd.send(ss.str());
+    }
+    cmd.send("start");
+  }
+
+  const auto start{steady_clock::now()};
+  const auto end{start + duration<double>(opt.duration)};
+  auto       next_print{start + seconds(1)};
+  uint64_t   last_received{0};
+
+  while (steady_clock::now() < end) {
+    struct pollfd pfd {
+      fd, POLLIN, 0
+    };
+    poll(&pfd, 1, 100);
+
+    while (receive(fd, buf, sizeof(buf), n, arrival_ns)) {
+      DataHeader h;
+      if (static_cast<size_t>(n) < sizeof(h))
+        continue;
+      std::memcpy(&h, buf, sizeof(h));
+      if (h.magic != DATA_MAGIC || h.version != DATA_VERSION)
+        continue;
+      streams[h.board].add(h, arrival_ns);
+    }
+
+    cmd.printReplies();
+    if (steady_clock::now() >= next_print) {
+      next_print += seconds(1);
+      uint64_t received{0}, lost{0};
+      for (auto& [board, s] : streams) {
+        received += s.received();
+        lost += s.lost();
+      }
+      std::printf("%8llu frames/s  %8llu lost  jitter",
+                  (unsigned long long)(received - last_received),
+                  (unsigned long long)lost);
+      for (auto& [board, s] : streams)
+        std::printf(" %.1f us", s.jitterUs());
+      std::printf("\n");
+      std::fflush(stdout);
+      last_received = received;
+    }
+  }
+
+  if (source) {
+    source->request_stop();
+    source->join();
+  } else {
+    cmd.send("stop");
+    std::this_thread::sleep_for(milliseconds(CLIENT_SETTLE_MS));
+    cmd.printReplies();
+  }
+
+  // One summary per run: the worst board, frames summed
+  RunResult r{T2, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1, -1};
+  for (auto& [board, s] : streams) {
+    r.received += s.received();
+    r.expected += s.expected();
+    r.lost += s.lost();
+    r.reordered += s.reordered();
+    r.duplicates += s.duplicates();
+    r.jitter_us      = std::max(r.jitter_us, s.jitterUs());
+    r.max_jitter_us  = std::max(r.max_jitter_us, s.maxJitterUs());
+    r.max_gap_ms     = std::max(r.max_gap_ms, s.maxGapMs());
+    r.latency_p50_us = std::max(r.latency_p50_us, s.latencyUs(0.5));
+    r.latency_p99_us = std::max(r.latency_p99_us, s.latencyUs(0.99));
+    r.latency_max_us = std::max(r.latency_max_us, s.latencyUs(1.0));
+
+    std::printf("Board %d: %llu frames received of %llu, %llu lost, %llu "
+                "reordered, %llu duplicates, %llu retransmitted\n",
+                board, (unsigned long long)s.received(),
+                (unsigned long long)s.expected(),
+                (unsigned long long)s.lost(),
+                (unsigned long long)s.reordered(),
+                (unsigned long long)s.duplicates(),
+                (unsigned long long)s.retransmitted());
+  }
+  return r;
+}
+
+static double lossPercent(const RunResult& r) {
+  return r.expected ? 100.0 * r.lost / r.expected : 0.0;
+}
+
+static void printSummary(const std::vector<RunResult>& results) {
+  std::printf("\n%8s %10s %10s %8s %9s %6s %11s %11s %10s %10s %10s\n",
+              "T2 (us)", "received", "lost", "lost %", "reordered", "dups",
+              "jitter (us)", "max gap ms", "p50 (us)", "p99 (us)",
+              "max (us)");
+  for (const RunResult& r : results)
+    std::printf("%8.1f %10llu %10llu %8.3f %9llu %6llu %11.1f %11.2f %10.0f "
+                "%10.0f %10.0f\n",
+                r.T2, (unsigned long long)r.received,
+                (unsigned long long)r.lost, lossPercent(r),
+                (unsigned long long)r.reordered,
+                (unsigned long long)r.duplicates, r.jitter_us, r.max_gap_ms,
+                r.latency_p50_us, r.latency_p99_us, r.latency_max_us);
+}
+
+static void appendCsv(const std::string& path,
+                      const std::vector<RunResult>& results) {
+  FILE* fp{std::fopen(path.c_str(), "a")};
+  if (fp == nullptr) {
+    std::cerr << "Error opening " << path << '\n';
+    return;
+  }
+  if (std::ftell(fp) == 0)
+    std::fprintf(fp, "T2_us,received,expected,lost,reordered,duplicates,"
+                     "jitter_us,max_jitter_us,max_gap_ms,latency_p50_us,"
+                     "latency_p99_us,latency_max_us\n");
+  for (const RunResult& r : results)
+    std::fprintf(fp, "%.2f,%llu,%llu,%llu,%llu,%llu,%.2f,%.2f,%.3f,%.0f,%.0f,"
+                     "%.0f\n",
+                 r.T2, (unsigned long long)r.received,
+                 (unsigned long long)r.expected, (unsigned long long)r.lost,
+                 (unsigned long long)r.reordered,
+                 (unsigned long long)r.duplicates, r.jitter_us,
+                 r.max_jitter_us, r.max_gap_ms, r.latency_p50_us,
+                 r.latency_p99_us, r.latency_max_us);
+  std::fclose(fp);
+}
+
+int main(int argc, char* argv[]) {
+  Options                  opt;
+  std::vector<std::string> positional;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    const bool       has_value{i + 1 < argc};
+
+    if (arg == "-d" && has_value) {
+      opt.duration = atof(argv[++i]);
+    } else if (arg == "-T" && has_value) {
+      opt.T2 = static_cast<float>(atof(argv[++i]));
+    } else if (arg == "-s" && has_value) {
+      if (std::sscanf(argv[++i], "%f:%f:%f", &opt.sweep_from, &opt.sweep_to,
+                      &opt.sweep_step) != 3 ||
+          opt.sweep_step <= 0) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-b" && has_value) {
+      opt.board = atoi(argv[++i]);
+    } else if (arg == "-m" && has_value) {
+      opt.group = argv[++i];
+    } else if (arg == "-p" && has_value) {
+      opt.data_port = static_cast<uint16_t>(atoi(argv[++i]));
+    } else if (arg == "-L" && has_value) {
+      opt.max_loss = atof(argv[++i]);
+    } else if (arg == "-k") {
+      opt.kill = true;
+    } else if (arg == "-o" && has_value) {
+      opt.csv = argv[++i];
+    } else if (arg == "--replay" && has_value) {
+      opt.replay = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-') {
+      positional.emplace_back(arg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // <server> <port>, or only <port> when replaying
+  if (positional.size() != (opt.replay.empty() ? 2u : 1u) ||
+      opt.duration <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (opt.replay.empty())
+    opt.host = positional[0];
+  opt.port = static_cast<uint16_t>(atoi(positional.back().c_str()));
+
+  const uint16_t data_port{opt.data_port ? opt.data_port
+                                         : static_cast<uint16_t>(opt.port + 1)};
+  CommandSocket  cmd(opt);
+  if (opt.replay.empty() && !cmd.ok())
+    return 1;
+  const int fd{openDataSocket(opt, data_port)};
+  if (fd == -1)
+    return 1;
+
+  // Replays run at the T2 of the recording unless given
+  float T2{opt.T2};
+  if (!opt.replay.empty() && T2 <= 0) {
+    RecordingMeta meta;
+    readRecordingMeta(recordingBase(opt.replay), meta);
+    T2 = meta.T2;
+  }
+
+  std::vector<float> values;
+  if (opt.sweep_step > 0) {
+    const float dir{opt.sweep_to < opt.sweep_from ? -1.0f : 1.0f};
+    for (float t = opt.sweep_from;
+         dir * (t - opt.sweep_to) <= 1e-3f && values.size() < 1000;
+         t += dir * opt.sweep_step)
+      values.push_back(t);
+  } else {
+    values.push_back(T2);
+  }
+
+  std::vector<RunResult> results;
+  int                    status{0};
+  for (float value : values) {
+    if (values.size() > 1)
+      std::cout << "T2 = " << value << " us" << '\n';
+    results.push_back(run(opt, cmd, fd, data_port, value));
+    if (opt.max_loss >= 0 && lossPercent(results.back()) > opt.max_loss)
+      status = 1;
+  }
+
+  if (opt.kill)
+    cmd.send("kill");
+  close(fd);
+
+  printSummary(results);
+  if (!opt.csv.empty())
+    appendCsv(opt.csv, results);
+
+  return status;
+}
@@ -0,0 +1,422 @@
+/*
+ * ocmfet-convert: decode recordings into columnar files.
+ *
+ * The .bin file is decoded in parallel, each worker memory mapping a block of
+ * whole frames at a time, with the frame layout found in its .meta file. Each
+ * channel is written as a NumPy .npy array (or all of them as one CSV file)
+ * and the tags are written with the index of the sample they refer to.
+ */
+#include "frame_layout.hpp"
+#include "recording.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define CONVERT_BLOCK_FRAMES 32768 // frames decoded by a worker at a time
+
+static_assert(std::endian::native == std::endian::little,
+              "The .npy files are written in the native byte order");
+
+enum class Format { Npy, Csv };
+enum class Unit { uA, V, Raw };
+
+struct Options {
+  Format                      format{Format::Npy};
+  Unit                        unit{Unit::uA};
+  unsigned int                threads{0};
+  std::optional<BoardVariant> variant;
+  float                       T2{0};
+  std::string                 out_dir;
+};
+
+static void usage(const char* name) {
+  std::cerr << "Usage: " << name << " [options] <recording.bin>..." << '\n'
+            << "  -f npy|csv             output format (default: npy)" << '\n'
+            << "  -u uA|V|raw            unit of the samples (default: uA)"
+            << '\n'
+            << "  -j <threads>           worker threads (default: all cores)"
+            << '\n'
+            << "  -b feedback|nofeedback board variant, if there is no .meta"
+            << '\n'
+            << "  -T <us>                T2, if there is no .meta" << '\n'
+            << "  -o <dir>               output folder (default: next to the "
+               "recording)"
+            << '\n';
+}
+
+// uA with the calibration of the channel, as the server computes them
+static float scale(uint16_t raw, Unit unit,
+                   const BoardCalibration::Affine& cal) {
+  switch (unit) {
+  case Unit::V:
+    return static_cast<float>(mapRAWADCtoV(raw));
+  case Unit::Raw:
+    return static_cast<float>(raw);
+  case Unit::uA:
+  default:
+    return static_cast<float>(cal.gain * mapADCVto_uA(mapRAWADCtoV(raw)) +
+                              cal.offset);
+  }
+}
+
+static std::string_view unitName(Unit unit) {
+  return (unit == Unit::V) ? "V" : (unit == Unit::Raw) ? "raw" : "uA";
+}
+
+// Header of a NumPy (format 1.0) 1-D array of n values
+static std::string npyHeader(std::string_view dtype, uint64_t n) {
+  std::string dict{"{'descr': '" + std::string(dtype) +
+                   "', 'fortran_order': False, 'shape': (" +
+                   std::to_string(n) + ",), }"};
+
+  // Pad with spaces so that the data starts 64-byte aligned
+  const size_t unpadded{10 + dict.size() + 1};
+  dict += std::string((64 - unpadded % 64) % 64, ' ') + "\n";
+
+  std::string header{"\x93NUMPY\x01\x00", 8};
+  header += static_cast<char>(dict.size() & 0xFF);
+  header += static_cast<char>(dict.size() >> 8);
+  return header + dict;
+}
+
+static bool pwriteAll(int fd, const char* data, size_t len, off_t offset) {
+  while (len > 0) {
+    const ssize_t n{pwrite(fd, data, len, offset)};
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+    offset += n;
+  }
+  return true;
+}
+
+// Run worker(thread index) on n threads and wait for all of them
+template <typename F> static void parallel(unsigned int n, F&& worker) {
+  std::vector<std::jthread> pool;
+  for (unsigned int t = 1; t < n; t++)
+    pool.emplace_back(worker, t);
+  worker(0u);
+}
+
+/*
+ * One .npy file per channel. The files are sized up front, then every worker
+ * decodes a block of frames and writes its slice of each column in place.
+ */
+template <typename L>
+static bool convertNpy(const MappedRecording& rec, const std::string& out,
+                       const Options&                  opt,
+                       const BoardCalibration::Affine* cal) {
+  constexpr size_t n_ch{L::n_channels};
+  const uint64_t   n_frames{rec.frames()};
+  const uint64_t   n_samples{n_frames * L::n_samples};
+  const bool       raw{opt.unit == Unit::Raw};
+  const size_t     value_bytes{raw ? sizeof(uint16_t) : sizeof(float)};
+  const std::string header{npyHeader(raw ? "<u2" : "<f4", n_samples)};
+
+  int fds[n_ch];
+  for (size_t ch = 0; ch < n_ch; ch++) {
+    const std::string filename{out + "_ch" + std::to_string(ch + 1) + ".npy"};
+    fds[ch] = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fds[ch] == -1 ||
+        !pwriteAll(fds[ch], header.data(), header.size(), 0) ||
+        ftruncate(fds[ch], static_cast<off_t>(header.size() +
+                                              n_samples * value_bytes)) == -1) {
+      std::cerr << "Error creating " << filename << '\n';
+      for (size_t i = 0; i <= ch; i++)
+        if (fds[i] != -1)
+          close(fds[i]);
+      return false;
+    }
+    std::cout << "Writing " << filename << '\n';
+  }
+
+  std::atomic<uint64_t> next{0};
+  std::atomic_bool      failed{false};
+
+  parallel(opt.threads, [&](unsigned int) {
+    std::vector<uint16_t> words(CONVERT_BLOCK_FRAMES * L::n_samples * n_ch);
+    std::vector<char>     column(CONVERT_BLOCK_FRAMES * L::n_samples *
+                                 value_bytes);
+
+    while (!failed) {
+      const uint64_t first{next.fetch_add(CONVERT_BLOCK_FRAMES)};
+      if (first >= n_frames)
+        break;
+      const uint64_t n{std::min<uint64_t>(CONVERT_BLOCK_FRAMES,
+                                          n_frames - first)};
+
+      const MappedRecording::Window block(rec, first, n);
+      if (!block.ok()) {
+        failed = true;
+        break;
+      }
+      for (uint64_t f = 0; f < n; f++)
+        decodeFrame<L>(block.frame(first + f),
+                       &words[f * L::n_samples * n_ch]);
+
+      for (size_t ch = 0; ch < n_ch; ch++) {
+        const uint64_t count{n * L::n_samples};
+        if (raw) {
+          uint16_t* dst{reinterpret_cast<uint16_t*>(column.data())};
+          for (uint64_t i = 0; i < count; i++)
+            dst[i] = words[i * n_ch + ch];
+        } else {
+          float* dst{reinterpret_cast<float*>(column.data())};
+          for (uint64_t i = 0; i < count; i++)
+            dst[i] = scale(words[i * n_ch + ch], opt.unit, cal[ch]);
+        }
+
+        const off_t offset{static_cast<off_t>(
+            header.size() + first * L::n_samples * value_bytes)};
+        if (!pwriteAll(fds[ch], column.data(), count * value_bytes, offset))
+          failed = true;
+      }
+    }
+  });
+
+  for (size_t ch = 0; ch < n_ch; ch++)
+    close(fds[ch]);
+
+  if (failed)
+    std::cerr << "Error writing " << out << "_ch*.npy" << '\n';
+  return !failed;
+}
+
+/*
+ * A single CSV file. The lines do not have a fixed length, so the workers
+ * format consecutive blocks in rounds and the blocks are written in order.
+ */
+template <typename L>
+static bool convertCsv(const MappedRecording& rec, const std::string& out,
+                       const Options& opt, float T2,
+                       const BoardCalibration::Affine* cal) {
+  constexpr size_t  n_ch{L::n_channels};
+  const uint64_t    n_frames{rec.frames()};
+  const std::string filename{out + ".csv"};
+
+  FILE* fp{fopen(filename.c_str(), "w")};
+  if (fp == NULL) {
+    std::cerr << "Error creating " << filename << '\n';
+    return false;
+  }
+  std::cout << "Writing " << filename << '\n';
+
+  std::string header{"sample,time_s"};
+  for (size_t ch = 0; ch < n_ch; ch++)
+    header += ",ch" + std::to_string(ch + 1) + "_" +
+              std::string(unitName(opt.unit));
+  header += "\n";
+  fwrite(header.data(), 1, header.size(), fp);
+
+  std::vector<std::string> text(opt.threads);
+  std::atomic_bool         failed{false};
+  bool                     ok{true};
+
+  for (uint64_t round = 0; round < n_frames && ok;
+       round += opt.threads * CONVERT_BLOCK_FRAMES) {
+    parallel(opt.threads, [&](unsigned int t) {
+      std::string& s{text[t]};
+      s.clear();
+
+      const uint64_t first{round + t * CONVERT_BLOCK_FRAMES};
+      if (first >= n_frames)
+        return;
+      const uint64_t n{std::min<uint64_t>(CONVERT_BLOCK_FRAMES,
+                                          n_frames - first)};
+
+      const MappedRecording::Window block(rec, first, n);
+      if (!block.ok()) {
+        failed = true;
+        return;
+      }
+
+      uint16_t words[L::n_samples * n_ch];
+      char     buf[32];
+      for (uint64_t f = 0; f < n; f++) {
+        decodeFrame<L>(block.frame(first + f), words);
+        for (size_t i = 0; i < L::n_samples; i++) {
+          const uint64_t sample{(first + f) * L::n_samples + i};
+          s.append(buf, std::to_chars(buf, buf + sizeof(buf), sample).ptr);
+          s += ',';
+          s.append(buf, std::to_chars(buf, buf + sizeof(buf),
+                                      static_cast<double>(sample) * T2 / 1e6)
+                            .ptr);
+          for (size_t ch = 0; ch < n_ch; ch++) {
+            s += ',';
+            const uint16_t w{words[i * n_ch + ch]};
+            s.append(buf, (opt.unit == Unit::Raw)
+                              ? std::to_chars(buf, buf + sizeof(buf), w).ptr
+                              : std::to_chars(buf, buf + sizeof(buf),
+                                              scale(w, opt.unit, cal[ch]))
+                                    .ptr);
+          }
+          s += '\n';
+        }
+      }
+    });
+
+    if (failed)
+      ok = false;
+    for (const std::string& s : text)
+      if (ok && fwrite(s.data(), 1, s.size(), fp) != s.size())
+        ok = false;
+  }
+
+  if (fclose(fp) != 0 || !ok) {
+    std::cerr << "Error writing " << filename << '\n';
+    return false;
+  }
+  return true;
+}
+
+static bool writeTags(const std::vector<RecordingTag>& tags,
+                      const std::string& out, float T2) {
+  const std::string filename{out + "_tags.csv"};
+  FILE*             fp{fopen(filename.c_str(), "w")};
+  if (fp == NULL) {
+    std::cerr << "Error creating " << filename << '\n';
+    return false;
+  }
+
+  fprintf(fp, "sample,time_s,tag\n");
+  for (const RecordingTag& tag : tags)
+    fprintf(fp, "%llu,%.6f,%s\n", static_cast<unsigned long long>(tag.sample),
+            static_cast<double>(tag.sample) * T2 / 1e6, tag.text.c_str());
+  fclose(fp);
+
+  return true;
+}
+
+static bool convert(const std::string& path, const Options& opt) {
+  const std::string base{recordingBase(path)};
+
+  RecordingMeta meta;
+  if (!readRecordingMeta(base, meta) && !opt.variant)
+    std::cerr << "No " << base << ".meta, assuming a " << meta.info.name
+              << " board with T2 = " << meta.T2 << " us" << '\n';
+  if (opt.variant)
+    meta.info = frameInfo(*opt.variant);
+  if (opt.T2 > 0)
+    meta.T2 = opt.T2;
+
+  MappedRecording rec(path, meta.info.frame_len);
+  if (!rec.ok())
+    return false;
+  if (rec.trailingBytes() > 0)
+    std::cerr << "Ignoring " << rec.trailingBytes()
+              << " bytes of an incomplete frame at the end of " << path << '\n';
+
+  // Output next to the recording, or in the output folder
+  std::string out{base};
+  if (!opt.out_dir.empty()) {
+    const size_t slash{base.rfind('/')};
+    out = opt.out_dir + "/" +
+          ((slash == std::string::npos) ? base : base.substr(slash + 1));
+  }
+
+  const auto t0{std::chrono::steady_clock::now()};
+
+  const bool ok{visitLayout(meta.info.variant, [&](auto l) {
+    using L = decltype(l);
+    return (opt.format == Format::Csv)
+               ? convertCsv<L>(rec, out, opt, meta.T2, meta.cal)
+               : convertNpy<L>(rec, out, opt, meta.cal);
+  })};
+  if (!ok || !writeTags(readRecordingTags(base, meta.T2), out, meta.T2))
+    return false;
+
+  const double seconds{std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - t0)
+                           .count()};
+  const double mbytes{
+      static_cast<double>(rec.frames() * meta.info.frame_len) / 1e6};
+  std::cout << path << ": " << rec.frames() << " frames ("
+            << rec.frames() * meta.info.n_samples << " samples, "
+            << static_cast<double>(rec.frames() * meta.info.n_samples) *
+                   meta.T2 / 1e6
+            << " s) converted in " << seconds << " s (" << mbytes / seconds
+            << " MB/s)" << '\n';
+
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  Options                  opt;
+  std::vector<std::string> files;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    const bool       has_value{i + 1 < argc};
+
+    if (arg == "-f" && has_value) {
+      std::string_view value{argv[++i]};
+      if (value == "npy")
+        opt.format = Format::Npy;
+      else if (value == "csv")
+        opt.format = Format::Csv;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-u" && has_value) {
+      std::string_view value{argv[++i]};
+      if (value == "uA")
+        opt.unit = Unit::uA;
+      else if (value == "V")
+        opt.unit = Unit::V;
+      else if (value == "raw")
+        opt.unit = Unit::Raw;
+      else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-j" && has_value) {
+      opt.threads = static_cast<unsigned int>(atoi(argv[++i]));
+    } else if (arg == "-b" && has_value) {
+      opt.variant = parseBoardVariant(argv[++i]);
+      if (!opt.variant) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (arg == "-T" && has_value) {
+      opt.T2 = static_cast<float>(atof(argv[++i]));
+    } else if (arg == "-o" && has_value) {
+      opt.out_dir = argv[++i];
+    } else if (!arg.empty() && arg[0] != '-') {
+      files.emplace_back(arg);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (files.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (opt.threads == 0)
+    opt.threads = std::max(1u, std::thread::hardware_concurrency());
+
+  int status{0};
+  for (const std::string& file : files)
+    if (!convert(file, opt))
+      status = 1;
+
+  return status;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Data datagrams sent to the client's port + 1: a DataHeader followed by
+ * n_frames raw frames of frame_len bytes. The sequence number is the index
+ * of the first frame since the server started, per board; a client that
+ * sees a gap asks for the missing frames with "nack <first> <last>" on the
+ * command socket ("@<id> nack ..." with several boards) and receives them in
+ * datagrams flagged DATA_FLAG_RETRANSMIT, several frames per datagram.
+ * With DATA_FLAG_CALIBRATED ("scale ua" command), each frame holds the
+ * calibrated Ids of its samples as float32 uA instead of the raw big-endian
+ * ADC words, in the same order (frame_len is then twice the raw one).
+ * Little-endian, no padding.
+ */
+#define DATA_MAGIC           0xD5
+#define DATA_VERSION         1
+#define DATA_FLAG_RETRANSMIT 0x01
+#define DATA_FLAG_CALIBRATED 0x02
+
+struct __attribute__((packed)) DataHeader {
+  uint8_t  magic;
+  uint8_t  version;
+  uint8_t  flags;
+  uint8_t  board;
+  uint16_t n_frames;
+  uint16_t frame_len;
+  uint64_t seq;     // index of the first frame
+  uint64_t time_ns; // CLOCK_REALTIME at its ACK0 edge (0 if retransmitted)
+};
+
+static_assert(sizeof(DataHeader) == 24, "DataHeader must not be padded");
@@ -0,0 +1,233 @@
+#include "feedback.hpp"
+#include "cadence.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iomanip>
+#include <sstream>
+
+Feedback::Feedback(Board& board, const FrameInfo& info, float T2, Log log)
+    : board_(board), info_(info), log_(std::move(log)), changed_(false),
+      active_(false), T2_(T2) {
+  for (Channel& c : ch_) {
+    c.manual[0]      = 0;
+    c.manual[1]      = 0;
+    c.updates        = 0;
+    c.writes         = 0;
+    c.latency_sum_ns = 0;
+    c.latency_max_ns = 0;
+    c.ids            = 0;
+    c.output         = 0;
+    c.sum            = 0;
+    c.frames         = 0;
+    c.integral       = 0;
+    c.prev_error     = 0;
+    c.has_prev       = false;
+    c.bias           = 0;
+    c.out            = 0;
+    c.code           = -1;
+  }
+}
+
+bool Feedback::configure(int channel, Settings settings) {
+  if (channel < 1 || channel > FEEDBACK_CHANNELS ||
+      static_cast<size_t>(channel) > info_.n_channels)
+    return false;
+
+  // Never drive the DAC outside its range
+  const double top{outputMax(settings.output)};
+  settings.min   = std::clamp(settings.min, 0.0, top);
+  settings.max   = std::clamp(settings.max, settings.min, top);
+  settings.rate  = std::max(settings.rate, 0.0);
+  settings.every = std::max<uint32_t>(settings.every, 1);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  ch_[channel - 1].pending = settings;
+  changed_                 = true;
+  // The processing thread adopts the settings, then updates active_
+  active_ = true;
+  return true;
+}
+
+Feedback::Settings Feedback::settings(int channel) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ch_[channel - 1].pending;
+}
+
+Feedback::Stats Feedback::stats(int channel) const {
+  const Channel& c{ch_[channel - 1]};
+  return Stats{c.updates,        c.writes, c.latency_sum_ns,
+               c.latency_max_ns, c.ids,    c.output};
+}
+
+std::string Feedback::report(int channel) const {
+  const Settings s{settings(channel)};
+  const Stats    st{stats(channel)};
+  const bool     vg{s.output == Output::VG};
+  const char*    unit{vg ? " V" : " \u03BCA"};
+
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(3) << "PID " << channel << " "
+     << (s.enabled ? "on" : "off") << ": " << (vg ? "VG" : "I") << channel
+     << " in [" << s.min << ", " << s.max << "]" << unit << ", target "
+     << s.target << " \u03BCA, kp " << s.kp << ", ki " << s.ki << ", kd "
+     << s.kd << ", rate " << s.rate << unit << "/s, every " << s.every
+     << " frames; Ids " << st.ids << " \u03BCA, output " << st.output << unit
+     << ", " << st.updates << " updates, " << st.writes << " DAC writes";
+  if (st.writes > 0)
+    ss << std::setprecision(1) << ", SPI read to DAC write mean "
+       << st.latency_sum_ns / 1e3 / st.writes << " \u03BCs, max "
+       << st.latency_max_ns / 1e3 << " \u03BCs";
+  return ss.str();
+}
+
+void Feedback::resetStats(int channel) {
+  Channel& c{ch_[channel - 1]};
+  c.updates        = 0;
+  c.writes         = 0;
+  c.latency_sum_ns = 0;
+  c.latency_max_ns = 0;
+}
+
+bool Feedback::drives(Output output, int channel) const {
+  if (channel < 1 || channel > FEEDBACK_CHANNELS)
+    return false;
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Settings& s{ch_[channel - 1].pending};
+  return s.enabled && s.output == output;
+}
+
+void Feedback::setManual(Output output, int channel, double value) {
+  if (channel >= 1 && channel <= FEEDBACK_CHANNELS)
+    ch_[channel - 1].manual[static_cast<int>(output)] = value;
+}
+
+void Feedback::adopt() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  changed_ = false;
+
+  bool active{false};
+  for (Channel& c : ch_) {
+    const Settings& next{c.pending};
+    const bool      restart{next.enabled && (!c.settings.enabled ||
+                                          next.output != c.settings.output)};
+
+    // An output released by the loop keeps its last value
+    if (c.settings.enabled && (!next.enabled || restart))
+      c.manual[static_cast<int>(c.settings.output)] = c.out;
+
+    // Bumpless start from the value on the DAC, keep the state otherwise
+    if (restart) {
+      c.sum      = 0;
+      c.frames   = 0;
+      c.integral = 0;
+      c.has_prev = false;
+      c.bias     = std::clamp<double>(c.manual[static_cast<int>(next.output)],
+                                      next.min, next.max);
+      c.out      = c.bias;
+      c.code     = -1; // the clamped value may not be on the DAC yet
+      c.output   = c.out;
+    }
+    c.settings = next;
+    active     = active || next.enabled;
+  }
+  active_ = active;
+}
+
+void Feedback::update(const char* frame, uint64_t seq, uint64_t read_ns) {
+  if (changed_.load(std::memory_order_acquire))
+    adopt();
+
+  // Mean Ids of each channel over the frame
+  const unsigned char* p{reinterpret_cast<const unsigned char*>(frame)};
+  const size_t         n_ch{info_.n_channels};
+  for (size_t ch = 0; ch < FEEDBACK_CHANNELS && ch < n_ch; ch++) {
+    Channel& c{ch_[ch]};
+    if (!c.settings.enabled)
+      continue;
+
+    double sum{0};
+    for (size_t i = 0; i < info_.n_samples; i++) {
+      const unsigned char* s{p + 2 * (i * n_ch + ch)};
+      sum += board_.cal.uA(static_cast<int>(ch) + 1, (s[0] << 8) | s[1]);
+    }
+    c.sum += sum / (double)info_.n_samples;
+
+    if (++c.frames >= c.settings.every)
+      control(static_cast<int>(ch) + 1, c, seq, read_ns);
+  }
+}
+
+void Feedback::control(int channel, Channel& c, uint64_t seq,
+                       uint64_t read_ns) {
+  const Settings& s{c.settings};
+  const double    ids{c.sum / c.frames};
+  const double    dt{c.frames * info_.n_samples * T2_ * 1e-6};
+  c.sum    = 0;
+  c.frames = 0;
+  c.ids    = ids;
+  c.updates.store(c.updates.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+
+  // PID law around the output the loop started from
+  const double error{s.target - ids};
+  const double derivative{c.has_prev ? (error - c.prev_error) / dt : 0.0};
+  c.prev_error = error;
+  c.has_prev   = true;
+
+  const double integral{c.integral + error * dt};
+  const double raw{c.bias + s.kp * error + s.ki * integral +
+                   s.kd * derivative};
+  const double clamped{std::clamp(raw, s.min, s.max)};
+  // Anti-windup: no integration further into the saturation
+  const bool windup{(raw > s.max && s.ki * error > 0) ||
+                    (raw < s.min && s.ki * error < 0)};
+  if (!windup)
+    c.integral = integral;
+
+  // Slew-rate limit
+  const double step{s.rate * dt};
+  const double out{std::clamp(clamped, c.out - step, c.out + step)};
+  c.out = out;
+
+  const int code{board_.cal.dacCode((s.output == Output::VG)
+                                         ? BoardCalibration::Dac::VG
+                                         : BoardCalibration::Dac::Isetpoint,
+                                     channel, out)};
+  if (code == c.code)
+    return;
+
+  const int status{(s.output == Output::VG) ? set_VG(board_, out, channel)
+                                            : set_Vsetpoint(board_, out,
+                                                            channel)};
+  const uint64_t latency_ns{monotonicRawNs() - read_ns};
+  if (status == -1) {
+    c.code = -1;
+    return;
+  }
+
+  c.latency_sum_ns.store(c.latency_sum_ns.load(std::memory_order_relaxed) +
+                             latency_ns,
+                         std::memory_order_relaxed);
+  if (latency_ns > c.latency_max_ns.load(std::memory_order_relaxed))
+    c.latency_max_ns.store(latency_ns, std::memory_order_relaxed);
+  c.code   = code;
+  c.output = out;
+  c.writes.store(c.writes.load(std::memory_order_relaxed) + 1,
+                 std::memory_order_relaxed);
+
+  const bool vg{s.output == Output::VG};
+  LOG_DEBUG("Board {}: pid {}{} {} {} at frame {}, Ids {} uA", board_.cfg.id,
+            vg ? "VG" : "I", channel, out, vg ? "V" : "uA", seq, ids);
+  log_(Actuation{seq, s.output, channel, out, ids});
+}
+
+std::string Feedback::describe(const Actuation& a) {
+  const bool vg{a.output == Output::VG};
+  char       buf[64];
+  snprintf(buf, sizeof(buf), "pid %s%d %.3f %s, Ids %.3f uA", vg ? "VG" : "I",
+           a.channel, a.value, vg ? "V" : "uA", a.ids);
+  return std::string(buf);
+}
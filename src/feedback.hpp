@@ -0,0 +1,125 @@
+#pragma once
+
+#include "frame_layout.hpp"
+#include "hw_peripherals.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#define FEEDBACK_CHANNELS 2
+#define FEEDBACK_EVERY    4   // default frames averaged per control update
+#define FEEDBACK_RATE     1.0 // default largest output change per second
+#define DAC_VMAX          (G * V_REF * 4095 / 4096) // highest DAC output (V)
+
+/*
+ * Software feedback loop from the drain current of each channel to one of
+ * its DAC outputs: VG (V) or the current setpoint of the analog loop (uA).
+ * update() runs in the processing thread right after the SPI read: the mean
+ * Ids over `every` frames goes through a PID law, the output is clamped to
+ * [min, max] and slew-limited to `rate` units per second, and the DAC is
+ * written only when its code changes. The time from the end of the SPI read
+ * to the end of the DAC write is measured for each write, and each write is
+ * logged (debug level) with the sequence number of its frame.
+ *
+ * configure() and the accessors can be called from any thread; the new
+ * settings are picked up by the processing thread at its next frame.
+ */
+class Feedback {
+public:
+  enum class Output { VG, Isetpoint };
+
+  struct Settings {
+    bool     enabled{false};
+    Output   output{Output::VG};
+    double   target{0}; // uA
+    double   kp{0};     // output units per uA
+    double   ki{0};     // output units per uA s
+    double   kd{0};     // output units per uA/s
+    double   min{0};
+    double   max{DAC_VMAX};
+    double   rate{FEEDBACK_RATE}; // output units per second
+    uint32_t every{FEEDBACK_EVERY};
+  };
+
+  struct Stats {
+    uint64_t updates;
+    uint64_t writes;
+    uint64_t latency_sum_ns; // end of SPI read to end of DAC write
+    uint64_t latency_max_ns;
+    double   ids;    // last mean Ids (uA)
+    double   output; // last output written
+  };
+
+  // A DAC write and the frame it was computed from
+  struct Actuation {
+    uint64_t frame; // ring sequence number
+    Output   output;
+    int      channel;
+    double   value;
+    double   ids; // mean Ids behind the value (uA)
+  };
+
+  // Called after each actuation, e.g. to tag a recording
+  using Log = std::function<void(const Actuation&)>;
+
+  Feedback(Board&, const FrameInfo&, float, Log);
+
+  bool        configure(int, Settings); // false if the channel is invalid
+  Settings    settings(int) const;
+  Stats       stats(int) const;
+  std::string report(int) const;
+  void        resetStats(int);
+  bool        drives(Output, int) const;
+  void        setManual(Output, int, double); // value written by a command
+  void        setT2(float T2) { T2_ = T2; }
+  bool        active() const { return active_.load(std::memory_order_relaxed); }
+
+  static double outputMax(Output o) {
+    return (o == Output::VG) ? DAC_VMAX : 2 * DAC_VMAX;
+  }
+  static std::string describe(const Actuation&);
+
+  // Frame, its ring sequence number, end of its SPI read
+  void update(const char*, uint64_t, uint64_t);
+
+private:
+  struct Channel {
+    // Shared with the other threads
+    Settings              pending;
+    std::atomic<double>   manual[2]; // last value written by a command
+    std::atomic<uint64_t> updates;
+    std::atomic<uint64_t> writes;
+    std::atomic<uint64_t> latency_sum_ns;
+    std::atomic<uint64_t> latency_max_ns;
+    std::atomic<double>   ids;
+    std::atomic<double>   output;
+
+    // Owned by the processing thread
+    Settings settings;
+    double   sum;
+    uint32_t frames;
+    double   integral;
+    double   prev_error;
+    bool     has_prev;
+    double   bias; // output when the loop started
+    double   out;
+    int      code; // last DAC code written, -1: none
+  };
+
+  void adopt();
+  void control(int, Channel&, uint64_t, uint64_t);
+
+  Board&          board_;
+  const FrameInfo info_;
+  Log             log_;
+
+  mutable std::mutex mutex_; // pending settings
+  std::atomic_bool   changed_;
+  std::atomic_bool   active_;
+  std::atomic<float> T2_;
+  Channel            ch_[FEEDBACK_CHANNELS];
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <numbers>
+#include <vector>
+
+/*
+ * Iterative radix-2 FFT with precomputed twiddle factors and bit-reversal
+ * permutation. One plan per transform size, transform() is const and can be
+ * shared between threads.
+ */
+class FFT {
+public:
+  explicit FFT(size_t n) : n_(n), rev_(n), twiddle_(n / 2) {
+    size_t bits{0};
+    while ((size_t{1} << bits) < n_)
+      bits++;
+
+    for (size_t i = 0; i < n_; i++) {
+      size_t r{0};
+      for (size_t b = 0; b < bits; b++)
+        r |= ((i >> b) & 1) << (bits - 1 - b);
+      rev_[i] = r;
+    }
+
+    for (size_t k = 0; k < n_ / 2; k++)
+      twiddle_[k] = std::polar(1.0, -2.0 * std::numbers::pi * (double)k /
+                                        (double)n_);
+  }
+
+  size_t size() const { return n_; }
+
+  static bool isPowerOfTwo(size_t n) { return n > 0 && (n & (n - 1)) == 0; }
+
+  // In-place forward transform of n_ values
+  void transform(std::complex<double>* a) const {
+    for (size_t i = 0; i < n_; i++)
+      if (i < rev_[i])
+        std::swap(a[i], a[rev_[i]]);
+
+    for (size_t len = 2; len <= n_; len <<= 1) {
+      const size_t half{len / 2};
+      const size_t step{n_ / len};
+      for (size_t i = 0; i < n_; i += len) {
+        for (size_t j = 0; j < half; j++) {
+          const std::complex<double> t{a[i + j + half] * twiddle_[j * step]};
+          a[i + j + half] = a[i + j] - t;
+          a[i + j] += t;
+        }
+      }
+    }
+  }
+
+private:
+  size_t                            n_;
+  std::vector<size_t>               rev_;
+  std::vector<std::complex<double>> twiddle_;
+};
+
+// Hann window of n points (periodic, as used for spectral estimation)
+inline std::vector<double> hannWindow(size_t n) {
+  std::vector<double> w(n);
+  for (size_t i = 0; i < n; i++)
+    w[i] = 0.5 - 0.5 * std::cos(2.0 * std::numbers::pi * (double)i /
+                                (double)n);
+  return w;
+}
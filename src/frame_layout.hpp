@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+// ADC-related defines
+#define ADC_VMIN_V -5.0 // Volt
+#define ADC_VMAX_V 5.0  // Volt
+#define mapRAWADCtoV(x)                                                        \
+  (double)((x) * (ADC_VMAX_V - ADC_VMIN_V) / 65536.0 + ADC_VMIN_V)
+#define mapADCVto_uA(x) ((x) * 0.2)
+
+// Largest frame of all the supported board variants (sizes static buffers)
+#define MAX_BUF_LEN 36
+
+enum class BoardVariant : uint8_t { Feedback = 0, NoFeedback = 1 };
+
+/*
+ * Layout of a frame read from the dsPIC with one SPI transfer: n_samples
+ * consecutive acquisitions, each made of n_channels 16-bit big-endian ADC
+ * words. One sample slot is thus 4 bytes wide and lasts T2.
+ */
+template <BoardVariant V, size_t FrameLen> struct FrameLayout {
+  static constexpr BoardVariant variant{V};
+  static constexpr size_t       frame_len{FrameLen};
+  static constexpr size_t       n_channels{2};
+  static constexpr size_t       sample_bytes{2};
+  static constexpr size_t       slot_bytes{n_channels * sample_bytes};
+  static constexpr size_t       n_samples{frame_len / slot_bytes};
+
+  static constexpr size_t offset(size_t sample, size_t ch) {
+    return sample * slot_bytes + ch * sample_bytes;
+  }
+
+  static_assert(frame_len % slot_bytes == 0, "Frame must hold whole samples");
+  static_assert(frame_len <= MAX_BUF_LEN, "MAX_BUF_LEN is too small");
+};
+
+using FeedbackLayout   = FrameLayout<BoardVariant::Feedback, 32>;
+using NoFeedbackLayout = FrameLayout<BoardVariant::NoFeedback, 36>;
+
+/*
+ * Runtime view of a layout, for the code paths that are not per-frame
+ * (metadata, tags, command replies)
+ */
+struct FrameInfo {
+  BoardVariant     variant;
+  std::string_view name;
+  size_t           frame_len;
+  size_t           n_channels;
+  size_t           n_samples;
+};
+
+constexpr std::string_view boardVariantName(BoardVariant v) {
+  return (v == BoardVariant::NoFeedback) ? "nofeedback" : "feedback";
+}
+
+template <typename L> constexpr FrameInfo frameInfo() {
+  return FrameInfo{L::variant, boardVariantName(L::variant), L::frame_len,
+                   L::n_channels, L::n_samples};
+}
+
+inline std::optional<BoardVariant> parseBoardVariant(std::string_view s) {
+  if (s == "feedback" || s == "fb")
+    return BoardVariant::Feedback;
+  if (s == "nofeedback" || s == "nofb")
+    return BoardVariant::NoFeedback;
+  return std::nullopt;
+}
+
+/*
+ * Call f with a default-constructed layout tag for the given variant, so that
+ * f can be a generic lambda instantiated once per layout.
+ */
+template <typename F> decltype(auto) visitLayout(BoardVariant v, F&& f) {
+  switch (v) {
+  case BoardVariant::NoFeedback:
+    return f(NoFeedbackLayout{});
+  case BoardVariant::Feedback:
+  default:
+    return f(FeedbackLayout{});
+  }
+}
+
+inline FrameInfo frameInfo(BoardVariant v) {
+  return visitLayout(v, [](auto l) { return frameInfo<decltype(l)>(); });
+}
+
+/*
+ * Decode the raw ADC words of a frame into out[sample * n_channels + ch]
+ */
+template <typename L>
+inline void decodeFrame(const char* frame, uint16_t* __restrict out) {
+  const unsigned char* p{reinterpret_cast<const unsigned char*>(frame)};
+  for (size_t i = 0; i < L::n_samples * L::n_channels; i++)
+    out[i] = static_cast<uint16_t>((p[2 * i] << 8) | p[2 * i + 1]);
+}
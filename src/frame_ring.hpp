@@ -0,0 +1,88 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/*
+ * Ring of the most recent frames, packed back to back so that any run of
+ * frames that does not wrap can be written to a file with a single call.
+ * One producer (the processing thread) pushes frames; readers address them by
+ * their absolute index and must check they have not been lapped.
+ */
+class FrameRing {
+public:
+  FrameRing(size_t capacity, size_t frame_len)
+      : frame_len_(frame_len), head_(0) {
+    // Round the capacity up to a power of two
+    capacity_ = 1;
+    while (capacity_ < capacity)
+      capacity_ <<= 1;
+    mask_ = capacity_ - 1;
+    buf_.resize(capacity_ * frame_len_);
+  }
+
+  void push(const char* frame) {
+    const uint64_t head{head_.load(std::memory_order_relaxed)};
+    std::memcpy(&buf_[(head & mask_) * frame_len_], frame, frame_len_);
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // Absolute index of the next frame to be pushed
+  uint64_t head() const { return head_.load(std::memory_order_acquire); }
+
+  const char* frame(uint64_t idx) const {
+    return &buf_[(idx & mask_) * frame_len_];
+  }
+
+  // Number of frames readable from idx without wrapping around
+  uint64_t contiguous(uint64_t idx) const { return capacity_ - (idx & mask_); }
+
+  /*
+   * True if the frame at idx is still in the ring. Called after reading the
+   * frame, it also tells that the read did not race with its overwrite: the
+   * producer may already be writing slot idx once head reaches idx + capacity.
+   */
+  bool valid(uint64_t idx) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return head() - idx < capacity_;
+  }
+
+  // Number of the frames [first, first + n) that are no longer valid
+  uint64_t overwritten(uint64_t first, uint64_t n) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const uint64_t h{head()};
+    if (h - first < capacity_)
+      return 0;
+    return std::min<uint64_t>(n, h - capacity_ - first + 1);
+  }
+
+  /*
+   * Copy the frames [first, first + n) to out. False if any of them is not
+   * in the ring, or was overwritten by a concurrent push() during the copy.
+   */
+  bool copy(uint64_t first, uint64_t n, char* out) const {
+    if (first + n > head() || head() - first >= capacity_)
+      return false;
+
+    for (uint64_t i = 0; i < n; i++)
+      std::memcpy(out + i * frame_len_, frame(first + i), frame_len_);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return head() - first < capacity_;
+  }
+
+  size_t capacity() const { return capacity_; }
+  size_t frameLen() const { return frame_len_; }
+  size_t bytes() const { return buf_.size(); }
+
+private:
+  size_t                frame_len_;
+  size_t                capacity_;
+  size_t                mask_;
+  std::vector<char>     buf_;
+  std::atomic<uint64_t> head_;
+};
@@ -1,6 +1,9 @@
 #include "hw_peripherals.hpp"
+#include "logger.hpp"
 
-#include <signal.h>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/time.h>
@@ -8,28 +11,98 @@
 #include <termios.h>
 #include <unistd.h>
 
-int              uart0_filestream;          // file descriptor for the UART
-int              last_response_status = -1; // last response status from the PIC
-struct cmd       last_cmd;                  // last command sent to the PIC
-struct termios   termAttr;                  // terminal attributes
-struct sigaction saio;                      // signal action
+std::mutex spiMutex; // the SPI peripheral is shared by the boards
+std::mutex dacMutex; // so are the SDATA and SCLK lines of the DACs
+
+bool parseBoardConfig(std::string_view spec, BoardConfig& cfg) {
+  // Comma-separated key=value pairs, e.g. "id=1,cs=1,req=5,ack0=6"
+  while (!spec.empty()) {
+    size_t           comma{spec.find(',')};
+    std::string_view item{spec.substr(0, comma)};
+    spec = (comma == std::string_view::npos) ? "" : spec.substr(comma + 1);
+
+    size_t eq{item.find('=')};
+    if (eq == std::string_view::npos)
+      return false;
+
+    std::string_view key{item.substr(0, eq)};
+    std::string      value{item.substr(eq + 1)};
+    try {
+      if (key == "id") {
+        cfg.id = std::stoi(value);
+      } else if (key == "variant") {
+        auto variant{parseBoardVariant(value)};
+        if (!variant)
+          return false;
+        cfg.variant = *variant;
+      } else if (key == "cs") {
+        cfg.spi_cs = std::stoi(value);
+      } else if (key == "req") {
+        cfg.req = std::stoi(value);
+      } else if (key == "ack0") {
+        cfg.ack0 = std::stoi(value);
+      } else if (key == "reset") {
+        cfg.reset = std::stoi(value);
+      } else if (key == "csn1") {
+        cfg.csn1 = std::stoi(value);
+      } else if (key == "csn2") {
+        cfg.csn2 = std::stoi(value);
+      } else if (key == "uart") {
+        cfg.uart = value;
+      } else if (key == "acq_core") {
+        cfg.acq_core = std::stoi(value);
+      } else if (key == "proc_core") {
+        cfg.proc_core = std::stoi(value);
+      } else if (key == "cal") {
+        cfg.cal = value;
+      } else {
+        return false;
+      }
+    } catch (const std::exception&) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool loadBoardCalibration(Board& board) {
+  // Without a cal key, the default file is optional
+  std::string path{board.cfg.cal};
+  if (path.empty()) {
+    path = BOARD_CAL_FOLDER "board" + std::to_string(board.cfg.id) + ".cal";
+    if (access(path.c_str(), F_OK) != 0) {
+      LOG_INFO("Board {}: no calibration file, nominal scaling", board.cfg.id);
+      return true;
+    }
+  }
 
-int init_system() {
+  if (!board.cal.load(path))
+    return false;
+  LOG_INFO("Board {}: {}", board.cfg.id, board.cal.report());
+  return true;
+}
+
+int init_system(std::vector<Board>& boards) {
   initBCM2835();
   setupSPI();
-  setupIO();
-  setupOpenConfigUSART0();
-  resetMCU();
+  setupSharedIO();
+
+  for (Board& board : boards) {
+    setupIO(board);
+    setupOpenConfigUSART(board);
+    resetMCU(board);
+  }
 
   return 0;
 }
 
 void initBCM2835() {
   if (!bcm2835_init()) {
-    printf("bcm2835_init failed. Are you running as root??\n");
+    LOG_ERROR("bcm2835_init failed. Are you running as root??");
     return;
   } else {
-    printf("bcm2835_init OK\n");
+    LOG_INFO("bcm2835_init OK");
   }
 }
 
@@ -40,22 +113,12 @@ void setupSPI() {
   bcm2835_spi_set_speed_hz(12500000); // on RPi4 this set fclock to 25 MHz
   bcm2835_spi_chipSelect(BCM2835_SPI_CS0);
   bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS0, LOW);
+  bcm2835_spi_setChipSelectPolarity(BCM2835_SPI_CS1, LOW);
 
-  printf("SPI setup done\n");
+  LOG_INFO("SPI setup done");
 }
 
-void setupIO() {
-  // Set REQ to be an output and preset it HIGH
-  bcm2835_gpio_fsel(REQ, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_write(REQ, HIGH);
-
-  // Set ACK0 to be an input with a pullup
-  bcm2835_gpio_fsel(ACK0, BCM2835_GPIO_FSEL_INPT);
-  bcm2835_gpio_set_pud(ACK0, BCM2835_GPIO_PUD_UP);
-
-  // Set RESET_MCU to be an input without pullup
-  bcm2835_gpio_fsel(RESET_MCU, BCM2835_GPIO_FSEL_INPT);
-
+void setupSharedIO() {
   // Set TP2 to be an output and preset it LOW
   bcm2835_gpio_fsel(TP2, BCM2835_GPIO_FSEL_OUTP);
   bcm2835_gpio_write(TP2, LOW);
@@ -63,138 +126,171 @@ void setupIO() {
   bcm2835_gpio_fsel(TP3, BCM2835_GPIO_FSEL_OUTP);
   bcm2835_gpio_write(TP3, LOW);
 
-  // Set the pin to be an output
+  // Set the DAC bus pins to be outputs
   bcm2835_gpio_fsel(SDATA, BCM2835_GPIO_FSEL_OUTP);
   bcm2835_gpio_fsel(SCLK, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_fsel(CSn1, BCM2835_GPIO_FSEL_OUTP);
-  bcm2835_gpio_fsel(CSn2, BCM2835_GPIO_FSEL_OUTP);
 
   // Set the pins to low
   bcm2835_gpio_write(SDATA, LOW);
   bcm2835_gpio_write(SCLK, LOW);
-  bcm2835_gpio_write(CSn1, HIGH);
-  bcm2835_gpio_write(CSn2, HIGH);
 
-  printf("IO setup done\n");
+  LOG_INFO("Shared IO setup done");
 }
 
-void resetMCU() {
+void setupIO(Board& board) {
+  const BoardConfig& cfg{board.cfg};
+
+  // Set REQ to be an output and preset it HIGH
+  bcm2835_gpio_fsel(cfg.req, BCM2835_GPIO_FSEL_OUTP);
+  bcm2835_gpio_write(cfg.req, HIGH);
+
+  // Set ACK0 to be an input with a pullup
+  bcm2835_gpio_fsel(cfg.ack0, BCM2835_GPIO_FSEL_INPT);
+  bcm2835_gpio_set_pud(cfg.ack0, BCM2835_GPIO_PUD_UP);
+
+  // Set RESET_MCU to be an input without pullup
+  bcm2835_gpio_fsel(cfg.reset, BCM2835_GPIO_FSEL_INPT);
+
+  // Set the DAC chip selects to be outputs, deselected
+  bcm2835_gpio_fsel(cfg.csn1, BCM2835_GPIO_FSEL_OUTP);
+  bcm2835_gpio_fsel(cfg.csn2, BCM2835_GPIO_FSEL_OUTP);
+  bcm2835_gpio_write(cfg.csn1, HIGH);
+  bcm2835_gpio_write(cfg.csn2, HIGH);
+
+  LOG_INFO("IO setup done (board {})", cfg.id);
+}
+
+void resetMCU(Board& board) {
   // Reset the MCU by setting RESET_MCU as output and LOW
-  bcm2835_gpio_fsel(RESET_MCU, BCM2835_GPIO_FSEL_OUTP);
+  bcm2835_gpio_fsel(board.cfg.reset, BCM2835_GPIO_FSEL_OUTP);
 
-  bcm2835_gpio_write(RESET_MCU, LOW);
+  bcm2835_gpio_write(board.cfg.reset, LOW);
   bcm2835_delay(100);
 
   // Set RESET_MCU as input
-  bcm2835_gpio_fsel(RESET_MCU, BCM2835_GPIO_FSEL_INPT);
+  bcm2835_gpio_fsel(board.cfg.reset, BCM2835_GPIO_FSEL_INPT);
 }
 
-void signal_handler_UART(int status) {
+/*
+ * Read what the PIC sent on the UART. Called when a command waits for its
+ * echo and by the server event loop for unsolicited bytes.
+ */
+ssize_t readUART(Board& board) {
   char buf[256];
 
-  ssize_t n{read(uart0_filestream, &buf, sizeof(buf))};
+  ssize_t n{read(board.uart_fd, &buf, sizeof(buf))};
 
   if (n > 0) {
-    D printf("Received %zd bytes from UART\n", n);
-    if (buf[0] == last_cmd.id)
-      last_response_status = 0;
-  } else {
-    D printf("Error reading from UART\n");
-    last_response_status = -1;
+    LOG_DEBUG("Received {} bytes from UART (board {})", n, board.cfg.id);
+    if (buf[0] == board.last_cmd.id)
+      board.last_response_status = 0;
   }
+
+  return n;
 }
 
-void setupOpenConfigUSART0() {
+void setupOpenConfigUSART(Board& board) {
   struct termios options;
 
-  uart0_filestream = -1;
-  uart0_filestream = open("/dev/serial0", O_RDWR | O_NOCTTY);
-  if (uart0_filestream == -1) {
+  board.uart_fd = open(board.cfg.uart.c_str(), O_RDWR | O_NOCTTY);
+  if (board.uart_fd == -1) {
     // ERROR - CAN'T OPEN SERIAL PORT
-    printf("Error - Unable to open UART. Ensure it is not in use by another "
-           "application\n");
+    LOG_ERROR("Error - Unable to open UART {}. Ensure it is not in use by "
+              "another application",
+              board.cfg.uart);
+    return;
   }
 
-  saio.sa_handler  = signal_handler_UART;
-  saio.sa_flags    = 0;
-  saio.sa_restorer = NULL;
-  sigaction(SIGIO, &saio, NULL);
-
-  fcntl(uart0_filestream, F_SETFL, FNDELAY);
-  fcntl(uart0_filestream, F_SETOWN, getpid());
-  fcntl(uart0_filestream, F_SETFL, O_ASYNC);
+  // Non-blocking, the responses are polled for
+  fcntl(board.uart_fd, F_SETFL, O_NONBLOCK);
 
-  tcgetattr(uart0_filestream, &options);
+  tcgetattr(board.uart_fd, &options);
   options.c_cflag = B115200 | CS8 | CLOCAL | CREAD;
   options.c_iflag = IGNPAR;
   options.c_oflag = 0;
   options.c_lflag = 0;
-  tcflush(uart0_filestream, TCIFLUSH);
-  tcsetattr(uart0_filestream, TCSANOW, &options);
+  tcflush(board.uart_fd, TCIFLUSH);
+  tcsetattr(board.uart_fd, TCSANOW, &options);
 
-  printf("UART setup done\n");
+  LOG_INFO("UART setup done (board {}, {})", board.cfg.id, board.cfg.uart);
 }
 
-void closeUSART0() { close(uart0_filestream); }
+void closeUSART(Board& board) { close(board.uart_fd); }
 
-void txByte(unsigned char c) {
-  if (uart0_filestream != -1) {
-    ssize_t count = write(uart0_filestream, &c, 1);
+void txByte(Board& board, unsigned char c) {
+  if (board.uart_fd != -1) {
+    ssize_t count = write(board.uart_fd, &c, 1);
     if (count < 0) {
-      printf("UART TX error\n");
+      LOG_ERROR("UART TX error");
     }
   }
 }
 
-int sendCommandTodsPic(struct cmd command) {
+int sendCommandTodsPic(Board& board, struct cmd command) {
   struct timeval sta, sto;
   long           s, us;
   double         ms;
 
-  last_response_status = -1;
-  last_cmd             = command;
+  board.last_response_status = -1;
+  board.last_cmd             = command;
+
+  if (board.uart_fd == -1)
+    return -1;
 
-  tcflush(uart0_filestream, TCIOFLUSH);
-  txByte(command.id);
+  tcflush(board.uart_fd, TCIOFLUSH);
+  txByte(board, command.id);
 
-  D printf("Sent command %c to dsPIC with parameters: ", command.id);
   for (int i = 0; i < command.numbytepars; i++)
-    txByte(command.bytePars[i]);
-
-  D {
-    for (int i = 0; i < command.numbytepars; i++) {
-      printf("%d ", command.bytePars[i]);
-    }
-    printf("\n");
+    txByte(board, command.bytePars[i]);
+
+  if (logEnabled(LogLevel::Debug)) {
+    std::string pars;
+    for (int i = 0; i < command.numbytepars; i++)
+      pars += std::to_string(command.bytePars[i]) + " ";
+    LOG_DEBUG("Sent command {} to dsPIC {} with parameters: {}",
+              static_cast<char>(command.id), board.cfg.id, pars);
   }
 
   // Wait for the response from the PIC for a maximum of TIMEOUT_RXBACK_CMD ms
   gettimeofday(&sta, NULL);
   ms = 0;
-  while ((last_response_status == -1) && (ms < TIMEOUT_RXBACK_CMD)) {
+  while ((board.last_response_status == -1) && (ms < TIMEOUT_RXBACK_CMD)) {
+    struct pollfd pfd {
+      board.uart_fd, POLLIN, 0
+    };
+    if (poll(&pfd, 1, TIMEOUT_RXBACK_CMD - static_cast<int>(ms)) > 0)
+      readUART(board);
+
     gettimeofday(&sto, NULL);
     s  = sto.tv_sec - sta.tv_sec;
     us = sto.tv_usec - sta.tv_usec;
     ms = (static_cast<double>(s) * 1000.0 + static_cast<double>(us) / 1000.0);
   }
 
-  return last_response_status;
+  return board.last_response_status;
 }
 
-void set_T2lock(unsigned char val) {
+void set_T2lock(Board& board, unsigned char val) {
   struct cmd command;
   command.id          = CMD_SET_T2LOCK;
   command.pars[0]     = val;
   command.numbytepars = 1;
   command.bytePars[0] = val;
 
-  if (sendCommandTodsPic(command) == 0) {
-    D printf("T2 lock set to %d\n", val);
+  if (sendCommandTodsPic(board, command) == 0) {
+    LOG_DEBUG("T2 lock set to {}", val);
   } else {
-    D printf("Error setting T2 lock\n");
+    LOG_ERROR("Error setting T2 lock");
   }
 }
 
+void spi_read_frame(Board& board, char* tx, char* rx, uint32_t len) {
+  std::lock_guard<std::mutex> lock(spiMutex);
+
+  bcm2835_spi_chipSelect(board.cfg.spi_cs);
+  bcm2835_spi_transfernb(tx, rx, len);
+}
+
 /*
  * Function to send a 16-bit data with simulated SPI
  */
@@ -243,57 +339,65 @@ int write_MCP4822(int ch, uint16_t data) {
   return 0;
 }
 
-int writeData(int adc, int ch, uint16_t data) {
+int writeData(Board& board, int adc, int ch, uint16_t data) {
+  uint8_t cs;
+
   // Select the adc
   if (adc == 1) {
-    bcm2835_gpio_write(CSn1, LOW);
+    cs = board.cfg.csn1;
   } else if (adc == 2) {
-    bcm2835_gpio_write(CSn2, LOW);
+    cs = board.cfg.csn2;
   } else {
     return -1;
   }
+
+  std::lock_guard<std::mutex> lock(dacMutex);
+
+  bcm2835_gpio_write(cs, LOW);
   // bcm2835_delayMicroseconds(30);
 
   // Write the data
   write_MCP4822(ch, data);
 
   // Deselect the adc
-  if (adc == 1) {
-    bcm2835_gpio_write(CSn1, HIGH);
-  } else if (adc == 2) {
-    bcm2835_gpio_write(CSn2, HIGH);
-  }
+  bcm2835_gpio_write(cs, HIGH);
 
   return 0;
 }
 
-int set_VG(double val, int ch) {
-  uint16_t data{mapVtoDAC(val)};
+int set_VG(Board& board, double val, int ch) {
+  if (ch < 1 || ch > BOARD_CAL_CHANNELS)
+    return -1;
+  // Closest code of the calibrated DAC output
+  uint16_t data{board.cal.dacCode(BoardCalibration::Dac::VG, ch, val)};
 
   // Write the data
-  if (writeData(ch, 2, data) == 0) {
-    D printf("VG%d set to %0.2f\n", ch, val);
+  if (writeData(board, ch, 2, data) == 0) {
+    LOG_DEBUG("VG{} set to {}", ch, val);
     return 0;
   } else {
-    D printf("Error setting VG%d\n", ch);
+    LOG_ERROR("Error setting VG{}", ch);
     return -1;
   }
 }
 
-int set_Vsetpoint(double val, int ch) {
-  uint16_t data{mapVtoDAC(val * 0.5)}; // uA to V
+int set_Vsetpoint(Board& board, double val, int ch) {
+  if (ch < 1 || ch > BOARD_CAL_CHANNELS)
+    return -1;
+  uint16_t data{
+      board.cal.dacCode(BoardCalibration::Dac::Isetpoint, ch, val)}; // uA
 
   // Write the data
-  if (writeData(ch, 1, data) == 0) {
-    D printf("Vsetpoint%d set to %0.2f\n", ch, val);
+  if (writeData(board, ch, 1, data) == 0) {
+    LOG_DEBUG("Vsetpoint{} set to {}", ch, val);
     return 0;
   } else {
-    D printf("Error setting Vsetpoint%d\n", ch);
+    LOG_ERROR("Error setting Vsetpoint{}", ch);
     return -1;
   }
 }
 
-int set_T2(double us) {
+int set_T2(Board& board, double us) {
   struct cmd command;
   command.id          = CMD_SET_TIM2PER;
   command.pars[0]     = DSPIC_CLOCK_MHz * us;
@@ -303,11 +407,11 @@ int set_T2(double us) {
   command.bytePars[0] = (unsigned char)((upar & 0xFF00) >> 8);
   command.bytePars[1] = (unsigned char)(upar & 0x00FF);
 
-  if (sendCommandTodsPic(command) == 0) {
-    D printf("T2 set to %0.2f\n", us);
+  if (sendCommandTodsPic(board, command) == 0) {
+    LOG_DEBUG("T2 set to {}", us);
     return 0;
   } else {
-    D printf("Error setting T2\n");
+    LOG_ERROR("Error setting T2");
     return -1;
   }
 }
@@ -1,15 +1,13 @@
 #pragma once
 
-#include <bcm2835.h>
-
-// #define DEBUG
-#ifdef DEBUG
-#define D if (1)
-#else
-#define D if (0)
-#endif
+#include "board_calibration.hpp"
+#include "frame_layout.hpp"
 
-// #define NO_FEEDBACK 1
+#include <bcm2835.h>
+#include <string>
+#include <sys/types.h>
+#include <string_view>
+#include <vector>
 
 #define T2_DEFAULT 44
 
@@ -55,11 +53,6 @@
 #define NO_BUFFER           -1
 #define BUFFER_A            0
 #define BUFFER_B            1
-#ifdef NO_FEEDBACK
-#define BUF_LEN 36
-#else
-#define BUF_LEN 32
-#endif
 
 // DAC-related defines
 #define V_REF  2.048 // Reference voltage
@@ -75,13 +68,6 @@
 #endif
 #define mapVtoDAC(x) (uint16_t)((x) * 4096 / (G * V_REF))
 
-// ADC-related defines
-#define ADC_VMIN_V -5.0 // Volt
-#define ADC_VMAX_V 5.0  // Volt
-#define mapRAWADCtoV(x)                                                        \
-  (double)((x) * (ADC_VMAX_V - ADC_VMIN_V) / 65536.0 + ADC_VMIN_V)
-#define mapADCVto_uA(x) ((x) * 0.2)
-
 // USART-related defines
 #define MAXPARS            5
 #define MAXBYTEPARS        10
@@ -96,21 +82,56 @@ struct cmd {
   unsigned char bytePars[MAXBYTEPARS]; // byte parameters
 };
 
-int  init_system();
-void initBCM2835(); // initialize the BCM2835 library
-void setupSPI();    // setup the SPI
-void setupIO();     // setup the IO
-void resetMCU();    // reset the MCU
-void signal_handler_UART(int);
-void setupOpenConfigUSART0(); // setup the USART
-void closeUSART0();
-void txByte(char);                   // send a byte to the PIC via the UART
-int  sendCommandTodsPic(struct cmd); // send a command to the dsPIC
-void set_T2lock(unsigned char);      // set the T2 lock
-int  my_spi_transfer(uint16_t);      // transfer data via simulated SPI
-int  write_MCP4882(int, uint16_t);   // write to the MPC4882
-int  writeData(int, int, uint16_t);  // write data to the two ADCs
-int  set_VG(double, int); // set the VG voltage for the specified channel
-int  set_Vsetpoint(double,
+// Default wiring, used by the first board
+#define MAX_BOARDS   4
+#define DEFAULT_UART "/dev/serial0"
+
+// Wiring of one acquisition board (GPIO numbers are BCM numbers)
+struct BoardConfig {
+  int          id{0};
+  BoardVariant variant{BoardVariant::Feedback};
+  uint8_t      spi_cs{BCM2835_SPI_CS0}; // chip select of the dsPIC
+  uint8_t      req{REQ};
+  uint8_t      ack0{ACK0};
+  uint8_t      reset{RESET_MCU};
+  uint8_t      csn1{CSn1}; // DAC chip selects
+  uint8_t      csn2{CSn2};
+  std::string  uart{DEFAULT_UART}; // dsPIC command port
+  int          acq_core{-1};       // CPU core of the acquisition thread
+  int          proc_core{-1};      // CPU core of the processing thread
+  std::string  cal;                // calibration file, empty: default path
+};
+
+// Runtime state of one board
+struct Board {
+  BoardConfig      cfg;
+  int              uart_fd{-1};              // file descriptor for the UART
+  int              last_response_status{-1}; // last status from the PIC
+  struct cmd       last_cmd {};              // last command sent to the PIC
+  BoardCalibration cal;                      // ADC and DAC tables
+};
+
+bool parseBoardConfig(std::string_view, BoardConfig&);
+bool loadBoardCalibration(Board&); // false if a file is invalid
+
+int  init_system(std::vector<Board>&);
+void initBCM2835();    // initialize the BCM2835 library
+void setupSPI();       // setup the SPI
+void setupSharedIO();  // setup the IO shared by all the boards
+void setupIO(Board&);  // setup the IO of a board
+void resetMCU(Board&); // reset the MCU
+ssize_t readUART(Board&);          // read the bytes received from the PIC
+void setupOpenConfigUSART(Board&); // setup the USART
+void closeUSART(Board&);
+void txByte(Board&, unsigned char); // send a byte to the PIC via the UART
+int  sendCommandTodsPic(Board&, struct cmd); // send a command to the dsPIC
+void set_T2lock(Board&, unsigned char);      // set the T2 lock
+void spi_read_frame(Board&, char*, char*, uint32_t); // read a dsPIC frame
+int  my_spi_transfer(uint16_t);             // transfer data via simulated SPI
+int  write_MCP4822(int, uint16_t);          // write to the MPC4822
+int  writeData(Board&, int, int, uint16_t); // write data to the two DACs
+int  set_VG(Board&, double,
+            int); // set the VG voltage for the specified channel
+int  set_Vsetpoint(Board&, double,
                    int); // set the Vsetpoint voltage for the specified channel
-int  set_T2(double);
+int  set_T2(Board&, double);
@@ -0,0 +1,196 @@
+#include "logger.hpp"
+#include "spsc_queue.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<LogLevel> log_level{LogLevel::Info};
+
+namespace {
+
+// Queue of one thread, kept by the logging thread until drained
+struct LogBuffer {
+  SpscQueue<LogRecord, LOG_QUEUE> queue;
+  std::atomic<uint64_t>           dropped{0};
+  std::atomic_bool                retired{false}; // the thread exited
+};
+
+struct LogState {
+  std::mutex                              mutex; // buffers, start/stop
+  std::vector<std::shared_ptr<LogBuffer>> buffers;
+  std::jthread                            thread;
+  FILE*                                   out{nullptr}; // null: console
+  std::vector<LogRecord>                  batch;
+  std::string                             line;
+  uint64_t                                retired_drops{0};
+  uint64_t                                reported_drops{0};
+};
+
+LogState& state() {
+  static LogState s;
+  return s;
+}
+
+// Registers the queue of the thread on its first record
+struct ThreadBuffer {
+  std::shared_ptr<LogBuffer> buffer;
+
+  ~ThreadBuffer() {
+    if (buffer)
+      buffer->retired = true;
+  }
+
+  LogBuffer& get() {
+    if (!buffer) {
+      buffer = std::make_shared<LogBuffer>();
+      std::lock_guard<std::mutex> lock(state().mutex);
+      state().buffers.push_back(buffer);
+    }
+    return *buffer;
+  }
+};
+
+thread_local ThreadBuffer thread_buffer;
+
+constexpr std::string_view level_names[]{"TRACE", "DEBUG", "INFO",
+                                         "WARN",  "ERROR", "OFF"};
+
+void writeRecord(LogState& s, const LogRecord& r) {
+  // HH:MM:SS.uuuuuu LEVEL message
+  const time_t t{static_cast<time_t>(r.time_ns / 1000000000ull)};
+  struct tm    tm;
+  localtime_r(&t, &tm);
+  char prefix[32];
+  std::snprintf(prefix, sizeof(prefix), "%02d:%02d:%02d.%06u %-5s ",
+                tm.tm_hour, tm.tm_min, tm.tm_sec,
+                static_cast<unsigned>(r.time_ns % 1000000000ull / 1000),
+                level_names[static_cast<int>(r.level)].data());
+
+  s.line = prefix;
+  r.format(s.line, r.fmt, r.payload);
+  s.line += '\n';
+
+  FILE* fp{s.out ? s.out : (r.level >= LogLevel::Warn ? stderr : stdout)};
+  std::fwrite(s.line.data(), 1, s.line.size(), fp);
+}
+
+// Called with the mutex held
+void drain(LogState& s) {
+  s.batch.clear();
+  uint64_t dropped{0};
+  for (auto& buffer : s.buffers) {
+    LogRecord record;
+    while (buffer->queue.pop(record))
+      s.batch.push_back(record);
+    dropped += buffer->dropped.load(std::memory_order_relaxed);
+  }
+
+  // Forget the threads that exited, their records are in the batch
+  s.buffers.erase(std::remove_if(s.buffers.begin(), s.buffers.end(),
+                                 [&s](const std::shared_ptr<LogBuffer>& b) {
+                                   if (!b->retired || b->queue.size() > 0)
+                                     return false;
+                                   s.retired_drops += b->dropped;
+                                   return true;
+                                 }),
+                  s.buffers.end());
+  dropped += s.retired_drops;
+
+  // The queues are in order, merge them
+  std::stable_sort(s.batch.begin(), s.batch.end(),
+                   [](const LogRecord& a, const LogRecord& b) {
+                     return a.time_ns < b.time_ns;
+                   });
+  for (const LogRecord& r : s.batch)
+    writeRecord(s, r);
+
+  if (dropped > s.reported_drops) {
+    FILE* fp{s.out ? s.out : stderr};
+    std::fprintf(fp, "%llu log records dropped\n",
+                 (unsigned long long)(dropped - s.reported_drops));
+    s.reported_drops = dropped;
+  }
+
+  if (!s.batch.empty()) {
+    std::fflush(s.out ? s.out : stdout);
+    std::fflush(stderr);
+  }
+}
+
+} // namespace
+
+std::optional<LogLevel> parseLogLevel(std::string_view name) {
+  for (size_t i = 0; i < std::size(level_names); i++) {
+    const std::string_view level{level_names[i]};
+    if (name.size() == level.size() &&
+        std::equal(name.begin(), name.end(), level.begin(),
+                   [](char a, char b) { return std::toupper(a) == b; }))
+      return static_cast<LogLevel>(i);
+  }
+  return std::nullopt;
+}
+
+std::string_view logLevelName(LogLevel level) {
+  return level_names[static_cast<int>(level)];
+}
+
+bool logPush(const LogRecord& record) {
+  LogBuffer& buffer{thread_buffer.get()};
+  if (buffer.queue.push(record))
+    return true;
+  buffer.dropped.store(buffer.dropped.load(std::memory_order_relaxed) + 1,
+                       std::memory_order_relaxed);
+  return false;
+}
+
+bool logStart(LogLevel level, const std::string& path) {
+  LogState& s{state()};
+  logStop();
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  if (!path.empty()) {
+    s.out = std::fopen(path.c_str(), "a");
+    if (s.out == nullptr) {
+      std::fprintf(stderr, "Error opening the log file %s\n", path.c_str());
+      return false;
+    }
+  }
+
+  log_level = level;
+  s.thread  = std::jthread([&s](std::stop_token st) {
+    while (!st.stop_requested()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(LOG_DRAIN_MS));
+      std::lock_guard<std::mutex> lock(s.mutex);
+      drain(s);
+    }
+  });
+  return true;
+}
+
+void logStop() {
+  LogState& s{state()};
+  if (s.thread.joinable()) {
+    s.thread.request_stop();
+    s.thread.join();
+  }
+
+  std::lock_guard<std::mutex> lock(s.mutex);
+  drain(s);
+  if (s.out != nullptr) {
+    std::fclose(s.out);
+    s.out = nullptr;
+  }
+}
+
+void logSetLevel(LogLevel level) { log_level = level; }
+
+uint64_t logDropped() {
+  LogState&                   s{state()};
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.reported_drops;
+}
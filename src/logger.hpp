@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <time.h>
+#include <type_traits>
+
+#define LOG_RECORD_SIZE 256  // bytes of a log record
+#define LOG_QUEUE       1024 // records buffered per thread
+#define LOG_DRAIN_MS    10   // period of the logging thread
+
+/*
+ * Asynchronous logger. LOG_INFO("T2 set to {} us", T2) costs one relaxed
+ * load when the level is disabled (the arguments are not even evaluated),
+ * and otherwise a copy of the arguments into a fixed-size record pushed
+ * into a lock-free queue owned by the calling thread: no formatting, no
+ * lock and no system call on the calling thread. A background thread
+ * drains the queues every LOG_DRAIN_MS, formats the records in time order
+ * and writes them to the console or to a file. A record is dropped (and
+ * counted) if the queue of its thread is full.
+ *
+ * The format must be a string literal; each {} is replaced by the next
+ * argument. The arguments are numbers or strings, the strings are copied
+ * (truncated to the space left in the record).
+ */
+enum class LogLevel : uint8_t { Trace, Debug, Info, Warn, Error, Off };
+
+std::optional<LogLevel> parseLogLevel(std::string_view);
+std::string_view        logLevelName(LogLevel);
+
+bool     logStart(LogLevel, const std::string&); // empty path: console
+void     logStop();                              // drain and flush
+void     logSetLevel(LogLevel);
+uint64_t logDropped();
+
+extern std::atomic<LogLevel> log_level;
+
+inline bool logEnabled(LogLevel level) {
+  return level >= log_level.load(std::memory_order_relaxed);
+}
+
+using LogFormatter = void (*)(std::string&, const char*, const char*);
+
+struct LogRecord {
+  uint64_t     time_ns; // CLOCK_REALTIME
+  LogFormatter format;
+  const char*  fmt;
+  LogLevel     level;
+  uint16_t     size; // payload bytes used
+  char         payload[LOG_RECORD_SIZE - 2 * sizeof(uint64_t) -
+                       sizeof(const char*) - 4];
+};
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "Unexpected padding");
+
+bool logPush(const LogRecord&);
+
+namespace logdetail {
+
+// Strings are stored as a 16-bit length and the bytes, numbers as they are
+template <typename T>
+using Stored = std::conditional_t<std::is_arithmetic_v<std::decay_t<T>>,
+                                  std::decay_t<T>, std::string_view>;
+
+template <typename T> constexpr size_t fixedSize() {
+  return std::is_arithmetic_v<T> ? sizeof(T) : sizeof(uint16_t);
+}
+
+// `room` always covers the fixed size, strings are truncated to fit
+template <typename T>
+inline size_t encode(char* p, size_t room, const T& value) {
+  if constexpr (std::is_arithmetic_v<T>) {
+    std::memcpy(p, &value, sizeof(T));
+    return sizeof(T);
+  } else {
+    const std::string_view s{value};
+    const uint16_t         len{static_cast<uint16_t>(
+        std::min(s.size(), room - sizeof(uint16_t)))};
+    std::memcpy(p, &len, sizeof(len));
+    std::memcpy(p + sizeof(len), s.data(), len);
+    return sizeof(len) + len;
+  }
+}
+
+template <typename T> inline T decode(const char*& p) {
+  if constexpr (std::is_arithmetic_v<T>) {
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    p += sizeof(T);
+    return value;
+  } else {
+    uint16_t len;
+    std::memcpy(&len, p, sizeof(len));
+    const std::string_view s{p + sizeof(len), len};
+    p += sizeof(len) + len;
+    return s;
+  }
+}
+
+template <typename T> inline void append(std::string& out, const T& value) {
+  if constexpr (std::is_same_v<T, bool>) {
+    out += value ? "true" : "false";
+  } else if constexpr (std::is_same_v<T, char>) {
+    out += value;
+  } else if constexpr (std::is_floating_point_v<T>) {
+    char buf[32];
+    const int n{std::snprintf(buf, sizeof(buf), "%g", (double)value)};
+    out.append(buf, n);
+  } else if constexpr (std::is_arithmetic_v<T>) {
+    char       buf[24];
+    const auto r{std::to_chars(buf, buf + sizeof(buf), value)};
+    out.append(buf, r.ptr - buf);
+  } else {
+    out += value;
+  }
+}
+
+// Copy the format up to the next {}, then the argument
+template <typename T>
+inline void formatNext(std::string& out, const char*& fmt, const T& value) {
+  const char* brace{std::strstr(fmt, "{}")};
+  if (brace == nullptr) {
+    out += fmt;
+    fmt += std::strlen(fmt);
+    return;
+  }
+  out.append(fmt, brace - fmt);
+  append(out, value);
+  fmt = brace + 2;
+}
+
+// Instantiated once per argument list, called by the logging thread
+template <typename... Args>
+void format(std::string& out, const char* fmt,
+            [[maybe_unused]] const char* payload) {
+  // A comma fold decodes the arguments in order
+  (formatNext(out, fmt, decode<Args>(payload)), ...);
+  out += fmt;
+}
+
+} // namespace logdetail
+
+template <size_t N, typename... Args>
+void logWrite(LogLevel level, const char (&fmt)[N], const Args&... args) {
+  LogRecord record;
+  record.level  = level;
+  record.fmt    = fmt;
+  record.format = &logdetail::format<logdetail::Stored<Args>...>;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  record.time_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ull +
+                   static_cast<uint64_t>(ts.tv_nsec);
+
+  // The strings share what the numbers leave of the payload
+  constexpr size_t fixed{(logdetail::fixedSize<logdetail::Stored<Args>>() +
+                          ... + 0)};
+  static_assert(fixed <= sizeof(record.payload), "Too many log arguments");
+
+  size_t size{0};
+  size_t reserved{fixed};
+  ((reserved -= logdetail::fixedSize<logdetail::Stored<Args>>(),
+    size += logdetail::encode<logdetail::Stored<Args>>(
+        record.payload + size, sizeof(record.payload) - size - reserved,
+        logdetail::Stored<Args>(args))),
+   ...);
+  record.size = static_cast<uint16_t>(size);
+
+  logPush(record);
+}
+
+#define LOG(level, ...)                                                        \
+  do {                                                                         \
+    if (logEnabled(level))                                                     \
+      logWrite(level, __VA_ARGS__);                                            \
+  } while (0)
+
+#define LOG_TRACE(...) LOG(LogLevel::Trace, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...)  LOG(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...)  LOG(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LogLevel::Error, __VA_ARGS__)
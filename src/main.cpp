@@ -1,29 +1,136 @@
 #include "hw_peripherals.hpp"
+#include "logger.hpp"
 #include "server.hpp"
 
+#include <csignal>
 #include <cstdint>
+#include <ctime>
 #include <iostream>
-#include <unistd.h>
+#include <optional>
+#include <pthread.h>
+#include <vector>
 
 constexpr std::string_view data_folder{"/home/pi/data/"};
 
+static void usage(const char* name) {
+  std::cerr << "Usage: " << name
+            << " <port> [feedback|nofeedback] [-b <board>]... "
+               "[--log-level <level>] [--log-file <path>]"
+            << '\n'
+            << "  <board>: comma-separated key=value pairs among id, variant, "
+               "cs, req, ack0, reset, csn1, csn2, uart, acq_core, proc_core, "
+               "cal"
+            << '\n'
+            << "  e.g. -b id=1,cs=1,req=5,ack0=6,reset=13,csn1=19,csn2=26,"
+               "uart=/dev/ttyAMA1"
+            << '\n'
+            << "  <level>: trace, debug, info (default), warn, error or off"
+            << '\n'
+            << "  --log-file: append the log to a file instead of the console"
+            << '\n';
+}
+
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr << "Usage: " << argv[0] << " <port>" << '\n';
+  if (argc < 2) {
+    usage(argv[0]);
 
     return 1;
   }
 
   const uint16_t port{static_cast<uint16_t>(atoi(argv[1]))};
 
-  init_system();
+  // The board variant selects the frame layout (default: feedback)
+  BoardVariant             variant{BoardVariant::Feedback};
+  std::vector<std::string> specs;
+  LogLevel                 level{LogLevel::Info};
+  std::string              log_file;
+  for (int i = 2; i < argc; i++) {
+    std::string_view arg{argv[i]};
+    if (arg == "-b" && i + 1 < argc) {
+      specs.push_back(argv[++i]);
+    } else if (arg == "--log-level" && i + 1 < argc) {
+      auto l{parseLogLevel(argv[++i])};
+      if (!l) {
+        usage(argv[0]);
+
+        return 1;
+      }
+      level = *l;
+    } else if (arg == "--log-file" && i + 1 < argc) {
+      log_file = argv[++i];
+    } else if (auto v = parseBoardVariant(arg)) {
+      variant = *v;
+    } else {
+      usage(argv[0]);
+
+      return 1;
+    }
+  }
+
+  // Without -b options, a single board with the default wiring
+  if (specs.empty())
+    specs.push_back("");
+
+  if (specs.size() > MAX_BOARDS) {
+    std::cerr << "At most " << MAX_BOARDS << " boards are supported" << '\n';
+
+    return 1;
+  }
+
+  // Boards must not move once initialized: size the vector up front
+  std::vector<Board> boards(specs.size());
+  for (size_t i = 0; i < specs.size(); i++) {
+    boards[i].cfg.id      = static_cast<int>(i);
+    boards[i].cfg.variant = variant;
+    if (!parseBoardConfig(specs[i], boards[i].cfg)) {
+      std::cerr << "Invalid board configuration: " << specs[i] << '\n';
 
+      return 1;
+    }
+  }
+
+  // SIGINT and SIGTERM are handled by the event loop of the server: block
+  // them before any thread starts, so that every thread inherits the mask
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  if (!logStart(level, log_file))
+    return 1;
+
+  // Calibration tables of each board, from <cal> or the default file
+  for (Board& board : boards) {
+    if (!loadBoardCalibration(board)) {
+      logStop();
+
+      return 1;
+    }
+  }
+
+  init_system(boards);
+
+  // The server restarts after a kill command, and exits on a signal
   while (true) {
-    Server server(port, data_folder, T2_DEFAULT);
-    server.run();
+    {
+      Server server(port, data_folder, T2_DEFAULT, boards);
+      server.run();
+      if (server.shutdownRequested())
+        break;
+    }
 
-    usleep(1000000);
+    const struct timespec restart_delay {
+      1, 0
+    };
+    if (sigtimedwait(&mask, NULL, &restart_delay) > 0)
+      break;
   }
 
+  for (Board& board : boards)
+    closeUSART(board);
+
+  logStop();
+
   return 0;
 }
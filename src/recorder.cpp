@@ -0,0 +1,501 @@
+#include "recorder.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+Recorder::Recorder(const FrameRing& ring, std::string_view data_folder,
+                   std::string_view cal_meta)
+    : ring_(ring), data_folder_(data_folder), cal_meta_(cal_meta),
+      active_(false), stopping_(false), stop_at_(0),
+      info_(frameInfo(BoardVariant::Feedback)), T2_(0), max_bytes_(0),
+      max_seconds_(0), tail_(0), lost_(0), seg_{},
+      rotating_(false), rot_bytes_(0), rot_seconds_(0), recorded_(0),
+      preroll_(0), finalizing_(false) {
+  writerThread_ =
+      std::jthread([this](std::stop_token st) { writerLoop(st); });
+  finalizerThread_ =
+      std::jthread([this](std::stop_token st) { finalizerLoop(st); });
+}
+
+Recorder::~Recorder() {
+  // Finalize the recording in progress, if any
+  stop();
+
+  writerThread_.request_stop();
+  cv_.notify_all();
+  writerThread_.join();
+  finalizerThread_.request_stop();
+  finalizerThread_.join();
+}
+
+void Recorder::start(std::string_view name, const FrameInfo& info, float T2,
+                     uint64_t preroll) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_)
+    return;
+
+  auto   now{std::chrono::system_clock::now()};
+  time_t now_c{std::chrono::system_clock::to_time_t(now)};
+
+  std::stringstream ss;
+  ss << std::put_time(std::localtime(&now_c), "%Y%m%d_%H%M%S");
+
+  name_        = name;
+  session_     = ss.str();
+  info_        = info;
+  T2_          = T2;
+  rotating_    = (max_bytes_ > 0) || (max_seconds_ > 0);
+  rot_bytes_   = max_bytes_;
+  rot_seconds_ = max_seconds_;
+  stopping_    = false;
+  skips_.clear();
+  incoming_tags_.clear();
+  tags_.clear();
+  seg_      = Segment{};
+  recorded_ = 0;
+  lost_     = 0;
+
+  // Start from the history already in the ring, leaving the writer some room
+  const uint64_t head{ring_.head()};
+  preroll  = std::min({preroll, head, (uint64_t)ring_.capacity() * 3 / 4});
+  tail_    = head - preroll;
+  preroll_ = preroll;
+  if (preroll > 0)
+    tags_.push_back(Tag{head, "trigger"});
+  active_ = true;
+}
+
+void Recorder::pause() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_ && (skips_.empty() || skips_.back().second != UINT64_MAX))
+    skips_.emplace_back(ring_.head(), UINT64_MAX);
+}
+
+void Recorder::resume() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_ && !skips_.empty() && skips_.back().second == UINT64_MAX)
+    skips_.back().second = ring_.head();
+}
+
+void Recorder::tag(const std::string& text) { tag(text, ring_.head()); }
+
+void Recorder::tag(const std::string& text, uint64_t frame) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (active_)
+    incoming_tags_.push_back(Tag{frame, text});
+
+  // Kept for the snapshots as long as their frame is in the ring
+  while (!recent_tags_.empty() &&
+         ring_.head() - recent_tags_.front().frame >= ring_.capacity())
+    recent_tags_.pop_front();
+  recent_tags_.push_back(Tag{frame, text});
+}
+
+std::vector<std::string> Recorder::stop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!active_)
+    return std::vector<std::string>{};
+
+  // Record everything pushed so far, then let the writer close the segment
+  stop_at_ = ring_.head();
+  if (!skips_.empty() && skips_.back().second == UINT64_MAX)
+    skips_.back().second = stop_at_;
+  stopping_ = true;
+  cv_.notify_all();
+  doneCV_.wait(lock, [this]() -> bool { return !active_; });
+  lock.unlock();
+
+  // Wait for the last segments to be on disk
+  std::unique_lock<std::mutex> flock(finMutex_);
+  finCV_.wait(flock,
+              [this]() -> bool { return finQueue_.empty() && !finalizing_; });
+
+  std::vector<std::string> files{std::move(files_)};
+  files_.clear();
+  return files;
+}
+
+void Recorder::setT2(float T2) { T2_ = T2; }
+
+void Recorder::setRotation(uint64_t max_mb, unsigned int max_minutes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_bytes_   = max_mb * 1024 * 1024;
+  max_seconds_ = max_minutes * 60;
+}
+
+void Recorder::writerLoop(std::stop_token stoken) {
+  while (!stoken.stop_requested()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, std::chrono::milliseconds(RECORDER_POLL_MS),
+                 [this, &stoken]() -> bool {
+                   return stopping_ || stoken.stop_requested();
+                 });
+    if (!active_)
+      continue;
+
+    // Take a snapshot of the shared state and do the I/O without the lock
+    const bool     stopping{stopping_};
+    const uint64_t limit{stopping ? stop_at_ : ring_.head()};
+    const auto     skips{skips_};
+    // A tag may refer to a frame before the last one (late ACK0 edges)
+    for (auto& t : incoming_tags_)
+      tags_.insert(std::upper_bound(tags_.begin(), tags_.end(), t.frame,
+                                    [](uint64_t frame, const Tag& other) {
+                                      return frame < other.frame;
+                                    }),
+                   std::move(t));
+    incoming_tags_.clear();
+    seg_.T2 = T2_;
+    lock.unlock();
+
+    writeFrames(limit, skips);
+
+    if (stopping && tail_ >= limit) {
+      // An empty recording still gets its (empty) files
+      if (seg_.fp == NULL && recorded_ == 0)
+        openSegment();
+      if (seg_.fp != NULL) {
+        emitTags(UINT64_MAX, UINT64_MAX);
+        closeSegment();
+      }
+
+      lock.lock();
+      active_   = false;
+      stopping_ = false;
+      doneCV_.notify_all();
+    }
+  }
+}
+
+void Recorder::writeFrames(
+    uint64_t limit, const std::vector<std::pair<uint64_t, uint64_t>>& skips) {
+  const size_t frame_len{ring_.frameLen()};
+  uint64_t     tail{tail_};
+
+  while (tail < limit) {
+    if (seg_.fp == NULL && !openSegment()) {
+      // Nowhere to write: drop the frames rather than stall the ring
+      lost_ += limit - tail;
+      tail_ = limit;
+      tags_.clear();
+      return;
+    }
+
+    // Frames overwritten before they could be written are lost
+    if (!ring_.valid(tail)) {
+      const uint64_t resume{
+          std::min(limit, ring_.head() - ring_.capacity() / 2)};
+      seg_.tags += std::to_string((double)(seg_.n_frames * info_.n_samples) *
+                                  seg_.T2 / 1e6) +
+                   ",overrun " + std::to_string(resume - tail) + " frames\n";
+      seg_.lost_frames += resume - tail;
+      lost_ += resume - tail;
+      tail = tail_ = resume;
+      continue;
+    }
+
+    // Skip the paused ranges, stop at the next one
+    uint64_t end{limit};
+    bool     skipped{false};
+    for (const auto& [from, to] : skips) {
+      if (tail >= from && tail < to) {
+        tail = tail_ = std::min(to, limit);
+        emitTags(tail, tail);
+        skipped = true;
+        break;
+      }
+      if (from > tail)
+        end = std::min(end, from);
+    }
+    if (skipped)
+      continue;
+
+    if (rotationDue()) {
+      closeSegment();
+      continue;
+    }
+
+    // Write a run of frames that neither wraps nor overflows the segment
+    end = std::min(end, tail + ring_.contiguous(tail));
+    if (rotating_ && rot_bytes_ > 0) {
+      const uint64_t room{(rot_bytes_ - seg_.n_frames * frame_len) / frame_len};
+      end = std::min(end, tail + std::max<uint64_t>(room, 1));
+    }
+
+    const uint64_t n{end - tail};
+    if (fwrite(ring_.frame(tail), frame_len, n, seg_.fp) != n)
+      LOG_ERROR("Error writing recording");
+
+    // The producer may have lapped us while we were writing
+    if (!ring_.valid(tail)) {
+      const uint64_t bad{ring_.overwritten(tail, n)};
+      seg_.tags += std::to_string((double)(seg_.n_frames * info_.n_samples) *
+                                  seg_.T2 / 1e6) +
+                   ",overrun " + std::to_string(bad) + " frames\n";
+      seg_.lost_frames += bad;
+      lost_ += bad;
+    }
+
+    seg_.n_frames += n;
+    emitTags(tail, end);
+    tail = tail_ = end;
+  }
+}
+
+/*
+ * Write the tags up to ring index `to` in the segment. Frames [from, to) are
+ * the last ones written, a tag is placed at the position of its frame.
+ */
+void Recorder::emitTags(uint64_t from, uint64_t to) {
+  const uint64_t first{seg_.n_frames - (to - from)};
+
+  while (!tags_.empty() && tags_.front().frame < to) {
+    const Tag&     t{tags_.front()};
+    const uint64_t pos{first + ((t.frame > from) ? t.frame - from : 0)};
+    const uint64_t samples{pos * info_.n_samples};
+
+    seg_.tags += std::to_string((double)samples * seg_.T2 / 1e6) + "," +
+                 t.text + "\n";
+    tags_.pop_front();
+  }
+}
+
+bool Recorder::openSegment() {
+  std::stringstream ss;
+  ss << data_folder_ << name_ << "_" << session_;
+  if (rotating_)
+    ss << "_" << std::setw(3) << std::setfill('0') << seg_.index;
+
+  seg_.base = ss.str();
+  seg_.fp   = fopen((seg_.base + ".bin.part").c_str(), "wb");
+  if (seg_.fp == NULL) {
+    LOG_ERROR("Error opening file");
+    return false;
+  }
+
+  seg_.tags        = "time,tag\n";
+  seg_.first_frame    = recorded_;
+  seg_.preroll_frames = (recorded_ == 0) ? preroll_ : 0;
+  seg_.n_frames    = 0;
+  seg_.lost_frames = 0;
+  seg_.start       = time(NULL);
+  seg_start_       = std::chrono::steady_clock::now();
+
+  return true;
+}
+
+// Hand the current segment over to the finalizer thread
+void Recorder::closeSegment() {
+  seg_.end = time(NULL);
+  recorded_ += seg_.n_frames;
+
+  std::unique_lock<std::mutex> lock(finMutex_);
+  finQueue_.push_back(seg_);
+  finCV_.notify_all();
+  lock.unlock();
+
+  const int index{seg_.index};
+  seg_       = Segment{};
+  seg_.index = index + 1;
+  seg_.T2    = T2_;
+}
+
+bool Recorder::rotationDue() const {
+  if (!rotating_ || seg_.n_frames == 0)
+    return false;
+
+  if (rot_bytes_ > 0 && seg_.n_frames * ring_.frameLen() >= rot_bytes_)
+    return true;
+
+  return rot_seconds_ > 0 && std::chrono::steady_clock::now() - seg_start_ >=
+                                 std::chrono::seconds(rot_seconds_);
+}
+
+void Recorder::finalizerLoop(std::stop_token stoken) {
+  while (true) {
+    std::unique_lock<std::mutex> lock(finMutex_);
+    finCV_.wait(lock, stoken, [this]() -> bool {
+      return !finQueue_.empty() || !snapQueue_.empty();
+    });
+
+    if (!finQueue_.empty()) {
+      Segment seg{std::move(finQueue_.front())};
+      finQueue_.pop_front();
+      finalizing_ = true;
+      lock.unlock();
+
+      finalizeSegment(seg);
+
+      lock.lock();
+      files_.push_back(seg.base + ".bin");
+      files_.push_back(seg.base + ".tags");
+      finalizing_ = false;
+      finCV_.notify_all();
+    } else if (!snapQueue_.empty()) {
+      Snapshot snap{std::move(snapQueue_.front())};
+      snapQueue_.pop_front();
+      lock.unlock();
+
+      writeSnapshot(snap);
+    } else {
+      return;
+    }
+  }
+}
+
+static void writeTextFile(const std::string& filename,
+                          const std::string& text) {
+  FILE* fp{fopen(filename.c_str(), "w")};
+  if (fp == NULL) {
+    LOG_ERROR("Error opening {}", filename);
+    return;
+  }
+
+  fwrite(text.c_str(), 1, text.length(), fp);
+  fclose(fp);
+}
+
+// Frame layout, so that the recording can be decoded offline
+static std::string layoutMeta(const FrameInfo& info, float T2) {
+  std::stringstream ss;
+  ss << "board=" << info.name << "\nframe_len=" << info.frame_len
+     << "\nn_channels=" << info.n_channels << "\nn_samples=" << info.n_samples
+     << "\nT2_us=" << T2 << "\n";
+  return ss.str();
+}
+
+static std::string isoTime(time_t t) {
+  char buf[32];
+  strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", localtime(&t));
+  return std::string(buf);
+}
+
+void Recorder::finalizeSegment(Segment& seg) {
+  // Flush the data to the card before exposing the final name
+  fflush(seg.fp);
+  fsync(fileno(seg.fp));
+  fclose(seg.fp);
+
+  std::string filename{seg.base + ".bin"};
+
+  writeTextFile(seg.base + ".tags", seg.tags);
+
+  // Position of the segment in the session
+  std::stringstream ss;
+  ss << layoutMeta(info_, seg.T2) << cal_meta_ << "segment=" << seg.index
+     << "\nfirst_frame=" << seg.first_frame << "\nn_frames=" << seg.n_frames
+     << "\nlost_frames=" << seg.lost_frames
+     << "\npreroll_frames=" << seg.preroll_frames
+     << "\nstart=" << isoTime(seg.start) << "\nend=" << isoTime(seg.end)
+     << "\n";
+  writeTextFile(seg.base + ".meta", ss.str());
+
+  if (rename((seg.base + ".bin.part").c_str(), filename.c_str()) != 0)
+    LOG_ERROR("Error renaming {}.bin.part", seg.base);
+
+  // Session index: one line per finalized segment
+  if (rotating_) {
+    std::string index_filename{data_folder_ + name_ + "_" + session_ +
+                               ".index"};
+    FILE*       fp{fopen(index_filename.c_str(), "a")};
+    if (fp != NULL) {
+      if (seg.index == 0)
+        fprintf(fp, "segment,file,first_frame,n_frames,start,end\n");
+      fprintf(fp, "%d,%s,%llu,%llu,%s,%s\n", seg.index, filename.c_str(),
+              (unsigned long long)seg.first_frame,
+              (unsigned long long)seg.n_frames, isoTime(seg.start).c_str(),
+              isoTime(seg.end).c_str());
+      fclose(fp);
+    }
+  }
+}
+
+std::string Recorder::snapshot(std::string_view name, const FrameInfo& info,
+                               float T2, uint64_t frames) {
+  auto   now{std::chrono::system_clock::now()};
+  time_t now_c{std::chrono::system_clock::to_time_t(now)};
+
+  // Milliseconds, two snapshots may be taken within a second
+  const auto ms{std::chrono::duration_cast<std::chrono::milliseconds>(
+                    now.time_since_epoch())
+                    .count() %
+                1000};
+
+  std::stringstream ss;
+  ss << data_folder_ << name << "_"
+     << std::put_time(std::localtime(&now_c), "%Y%m%d_%H%M%S") << "."
+     << std::setw(3) << std::setfill('0') << ms;
+
+  // Leave some room for the producer while the frames are written
+  const uint64_t last{ring_.head()};
+  frames = std::min({frames, last, (uint64_t)ring_.capacity() * 3 / 4});
+
+  // Tags of the frames in the snapshot, at the position of their frame
+  std::string tags{"time,tag\n"};
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const Tag& t : recent_tags_) {
+      if (t.frame < last - frames || t.frame >= last)
+        continue;
+      const uint64_t samples{(t.frame - (last - frames)) * info.n_samples};
+      tags += std::to_string((double)samples * T2 / 1e6) + "," + t.text + "\n";
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(finMutex_);
+  snapQueue_.push_back(Snapshot{ss.str(), std::move(tags), info, T2,
+                                last - frames, last, now_c});
+  finCV_.notify_all();
+
+  return ss.str() + ".bin";
+}
+
+void Recorder::writeSnapshot(const Snapshot& snap) {
+  if (access((snap.base + ".bin").c_str(), F_OK) == 0) {
+    LOG_ERROR("{}.bin already exists, snapshot not saved", snap.base);
+    return;
+  }
+
+  FILE* fp{fopen((snap.base + ".bin.part").c_str(), "wb")};
+  if (fp == NULL) {
+    LOG_ERROR("Error opening file");
+    return;
+  }
+
+  // Same as the writer thread, straight from the ring
+  uint64_t idx{snap.first};
+  uint64_t lost{0};
+  while (idx < snap.last) {
+    if (!ring_.valid(idx)) {
+      lost += snap.last - idx;
+      break;
+    }
+
+    const uint64_t n{std::min(snap.last - idx, ring_.contiguous(idx))};
+    fwrite(ring_.frame(idx), ring_.frameLen(), n, fp);
+    lost += ring_.overwritten(idx, n);
+    idx += n;
+  }
+
+  fflush(fp);
+  fsync(fileno(fp));
+  fclose(fp);
+
+  writeTextFile(snap.base + ".tags", snap.tags);
+
+  std::stringstream ss;
+  ss << layoutMeta(snap.info, snap.T2) << cal_meta_ << "snapshot=1\nn_frames="
+     << snap.last - snap.first << "\nlost_frames=" << lost
+     << "\nend=" << isoTime(snap.time) << "\n";
+  writeTextFile(snap.base + ".meta", ss.str());
+
+  if (rename((snap.base + ".bin.part").c_str(), (snap.base + ".bin").c_str()))
+    LOG_ERROR("Error renaming {}.bin.part", snap.base);
+  else
+    LOG_INFO("Snapshot saved to {}.bin", snap.base);
+}
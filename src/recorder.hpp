@@ -0,0 +1,136 @@
+#pragma once
+
+#include "frame_layout.hpp"
+#include "frame_ring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define RECORDER_POLL_MS 20 // period of the writer thread
+
+/*
+ * Streams the frames of a FrameRing to disk, optionally starting with the
+ * history already in the ring (pre-roll). A writer thread drains the ring
+ * into the current segment file; when the segment reaches the size or
+ * duration limit it is handed to a finalizer thread (flush, fsync, tags,
+ * metadata, rename) and a new segment starts with the next frame. The
+ * finalizer also writes snapshots of the ring, with the tags received while
+ * their frames were in it, recording or not. The acquisition and
+ * processing threads never touch the filesystem.
+ */
+class Recorder {
+public:
+  Recorder(const FrameRing&, std::string_view, std::string_view);
+  ~Recorder();
+
+  void        start(std::string_view, const FrameInfo&, float, uint64_t = 0);
+  std::string snapshot(std::string_view, const FrameInfo&, float, uint64_t);
+
+  void                     pause();
+  void                     resume();
+  void                     tag(const std::string&);
+  void                     tag(const std::string&, uint64_t); // at ring index
+  std::vector<std::string> stop();
+
+  void setT2(float);
+  void setRotation(uint64_t, unsigned int); // MB, minutes (0: no limit)
+
+  bool     active() const { return active_; }
+  uint64_t backlog() const { return ring_.head() - tail_; }
+  uint64_t lostFrames() const { return lost_; }
+
+private:
+  struct Tag {
+    uint64_t    frame; // ring index
+    std::string text;
+  };
+
+  struct Segment {
+    FILE*       fp;
+    std::string base;        // path without extension
+    std::string tags;        // CSV content of the .tags file
+    int         index;       // segment number in the session
+    uint64_t    first_frame; // recorded frames before this segment
+    uint64_t    n_frames;
+    uint64_t    lost_frames;
+    uint64_t    preroll_frames; // frames recorded before the trigger
+    float       T2;
+    time_t      start;
+    time_t      end;
+  };
+
+  // Standalone dump of the frames [first, last) of the ring
+  struct Snapshot {
+    std::string base;
+    std::string tags; // CSV content of the .tags file
+    FrameInfo   info;
+    float       T2;
+    uint64_t    first;
+    uint64_t    last;
+    time_t      time;
+  };
+
+  void writerLoop(std::stop_token);
+  void finalizerLoop(std::stop_token);
+  void finalizeSegment(Segment&);
+  void writeSnapshot(const Snapshot&);
+  void writeFrames(uint64_t, const std::vector<std::pair<uint64_t, uint64_t>>&);
+  void emitTags(uint64_t, uint64_t);
+  bool openSegment();
+  void closeSegment();
+  bool rotationDue() const;
+
+  const FrameRing&  ring_;
+  std::string       data_folder_;
+  const std::string cal_meta_; // calibration lines of the .meta files
+
+  // Shared with the writer thread, guarded by mutex_
+  std::mutex                                 mutex_;
+  std::condition_variable                    cv_;
+  std::condition_variable                    doneCV_;
+  std::atomic_bool                           active_;
+  bool                                       stopping_;
+  uint64_t                                   stop_at_;
+  std::vector<std::pair<uint64_t, uint64_t>> skips_; // paused ranges
+  std::vector<Tag>                           incoming_tags_;
+  std::deque<Tag>                            recent_tags_; // still in the ring
+  std::string                                name_;
+  std::string                                session_;
+  FrameInfo                                  info_;
+  std::atomic<float>                         T2_; // also read without the lock
+  uint64_t                                   max_bytes_; // for next session
+  unsigned int                               max_seconds_;
+
+  // Owned by the writer thread
+  std::atomic<uint64_t>                 tail_;
+  std::atomic<uint64_t>                 lost_;
+  std::deque<Tag>                       tags_;
+  Segment                               seg_;
+  bool                                  rotating_;
+  uint64_t                              rot_bytes_; // limits of the session
+  unsigned int                          rot_seconds_;
+  uint64_t                              recorded_;
+  uint64_t                              preroll_;
+  std::chrono::steady_clock::time_point seg_start_;
+
+  // Finalization queue, guarded by finMutex_
+  std::mutex                  finMutex_;
+  std::condition_variable_any finCV_;
+  std::deque<Segment>         finQueue_;
+  std::deque<Snapshot>        snapQueue_;
+  bool                        finalizing_;
+  std::vector<std::string>    files_;
+
+  std::jthread writerThread_;
+  std::jthread finalizerThread_;
+};
@@ -0,0 +1,177 @@
+#include "recording.hpp"
+
+#include <cmath>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string recordingBase(std::string_view path) {
+  for (std::string_view ext : {".bin.part", ".bin"}) {
+    if (path.size() > ext.size() &&
+        path.substr(path.size() - ext.size()) == ext)
+      return std::string(path.substr(0, path.size() - ext.size()));
+  }
+  return std::string(path);
+}
+
+bool readRecordingMeta(const std::string& base, RecordingMeta& meta) {
+  std::ifstream file(base + ".meta");
+  if (!file)
+    return false;
+
+  std::string line;
+  while (std::getline(file, line)) {
+    const size_t eq{line.find('=')};
+    if (eq == std::string::npos)
+      continue;
+
+    const std::string key{line.substr(0, eq)};
+    const std::string value{line.substr(eq + 1)};
+    if (key == "board") {
+      if (auto variant = parseBoardVariant(value))
+        meta.info = frameInfo(*variant);
+    } else if (key == "T2_us") {
+      try {
+        meta.T2 = std::stof(value);
+      } catch (const std::exception&) {
+        std::cerr << "Invalid T2 in " << base << ".meta" << '\n';
+      }
+    } else if (key.size() > 3 && key.compare(0, 2, "ch") == 0 &&
+               (key.substr(3) == "_gain" || key.substr(3) == "_offset")) {
+      // ch<n>_gain, ch<n>_offset
+      const int ch{key[2] - '0'};
+      if (ch < 1 || ch > BOARD_CAL_CHANNELS)
+        continue;
+      try {
+        double& coeff{(key.substr(3) == "_gain") ? meta.cal[ch - 1].gain
+                                                 : meta.cal[ch - 1].offset};
+        coeff = std::stod(value);
+      } catch (const std::exception&) {
+        std::cerr << "Invalid " << key << " in " << base << ".meta" << '\n';
+      }
+    }
+  }
+
+  meta.found = true;
+  return true;
+}
+
+std::vector<RecordingTag> readRecordingTags(const std::string& base,
+                                            float              T2) {
+  std::vector<RecordingTag> tags;
+  std::ifstream             file(base + ".tags");
+  if (!file)
+    return tags;
+
+  // "time,tag" header, then one line per tag (the text may contain commas)
+  std::string line;
+  std::getline(file, line);
+  while (std::getline(file, line)) {
+    const size_t comma{line.find(',')};
+    if (comma == std::string::npos)
+      continue;
+
+    try {
+      const double seconds{std::stod(line.substr(0, comma))};
+      tags.push_back(RecordingTag{
+          static_cast<uint64_t>(std::llround(seconds * 1e6 / T2)),
+          line.substr(comma + 1)});
+    } catch (const std::exception&) {
+      std::cerr << "Skipping invalid tag: " << line << '\n';
+    }
+  }
+
+  return tags;
+}
+
+MappedRecording::MappedRecording(const std::string& filename,
+                                 size_t             frame_len)
+    : filename_(filename), fd_(open(filename.c_str(), O_RDONLY)), size_(0),
+      frame_len_(frame_len) {
+  struct stat st;
+  if (fd_ == -1 || fstat(fd_, &st) == -1) {
+    std::cerr << "Error opening " << filename << '\n';
+    if (fd_ != -1)
+      close(fd_);
+    fd_ = -1;
+    return;
+  }
+
+  size_ = static_cast<uint64_t>(st.st_size);
+}
+
+MappedRecording::~MappedRecording() {
+  if (fd_ != -1)
+    close(fd_);
+}
+
+MappedRecording::Window::Window(const MappedRecording& rec, uint64_t first,
+                                uint64_t n)
+    : addr_(nullptr), len_(0), data_(nullptr), first_(first),
+      frame_len_(rec.frame_len_) {
+  if (n == 0)
+    return;
+
+  // mmap wants an offset that is a multiple of the page size
+  static const uint64_t page{static_cast<uint64_t>(sysconf(_SC_PAGESIZE))};
+  const uint64_t        offset{first * frame_len_};
+  const uint64_t        skip{offset % page};
+
+  len_ = static_cast<size_t>(skip + n * frame_len_);
+  void* addr{mmap(NULL, len_, PROT_READ, MAP_PRIVATE, rec.fd_,
+                  static_cast<off_t>(offset - skip))};
+  if (addr == MAP_FAILED) {
+    std::cerr << "Error mapping frames " << first << " to " << first + n - 1
+              << " of " << rec.filename_ << '\n';
+    len_ = 0;
+    return;
+  }
+
+  addr_ = addr;
+  data_ = static_cast<const char*>(addr) + skip;
+  // Read once front to back: let the kernel read ahead aggressively
+  madvise(addr, len_, MADV_SEQUENTIAL);
+}
+
+MappedRecording::Window::~Window() {
+  if (addr_ != nullptr)
+    munmap(addr_, len_);
+}
+
+RecordingFile::RecordingFile(const std::string& filename, size_t frame_len)
+    : fd_(open(filename.c_str(), O_RDONLY)), size_(0), frame_len_(frame_len) {
+  struct stat st;
+  if (fd_ == -1 || fstat(fd_, &st) == -1) {
+    std::cerr << "Error opening " << filename << '\n';
+    if (fd_ != -1)
+      close(fd_);
+    fd_ = -1;
+    return;
+  }
+
+  size_ = static_cast<uint64_t>(st.st_size);
+  posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+RecordingFile::~RecordingFile() {
+  if (fd_ != -1)
+    close(fd_);
+}
+
+bool RecordingFile::read(uint64_t first, uint64_t n, char* buf) const {
+  // A read is at most one chunk, the offset may be past 4 GB
+  size_t   len{static_cast<size_t>(n * frame_len_)};
+  uint64_t offset{first * frame_len_};
+  while (len > 0) {
+    const ssize_t r{pread(fd_, buf, len, static_cast<off_t>(offset))};
+    if (r <= 0)
+      return false;
+    buf += r;
+    len -= static_cast<size_t>(r);
+    offset += static_cast<uint64_t>(r);
+  }
+  return true;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "board_calibration.hpp"
+#include "frame_layout.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * Offline access to the recordings written by the Recorder: the .bin file of
+ * raw frames, the .meta file describing its layout and the .tags file. Shared
+ * by the command-line tools, no dependency on the acquisition hardware.
+ */
+struct RecordingMeta {
+  FrameInfo info{frameInfo(BoardVariant::Feedback)};
+  float     T2{T2_FALLBACK_US};
+  bool      found{false}; // false if the .meta file is missing
+
+  // Calibration of each channel at recording time (nominal if absent)
+  BoardCalibration::Affine cal[BOARD_CAL_CHANNELS];
+
+  static constexpr float T2_FALLBACK_US{44};
+};
+
+struct RecordingTag {
+  uint64_t    sample; // index of the sample the tag refers to
+  std::string text;
+};
+
+// Path of a recording without the .bin extension
+std::string recordingBase(std::string_view);
+
+// Read <base>.meta, keeping the defaults of `meta` for the missing keys
+bool readRecordingMeta(const std::string&, RecordingMeta&);
+
+// Read <base>.tags, converting the times to sample indices
+std::vector<RecordingTag> readRecordingTags(const std::string&, float);
+
+/*
+ * Read-only memory mappings of a .bin file. The file is mapped one window of
+ * frames at a time, so that recordings larger than the address space of a
+ * 32-bit Pi can be decoded. Only whole frames are exposed, a truncated last
+ * frame (e.g. an interrupted recording) is ignored.
+ */
+class MappedRecording {
+public:
+  // Frames [first, first + n) of the recording, unmapped on destruction
+  class Window {
+  public:
+    Window(const MappedRecording&, uint64_t, uint64_t); // first frame, count
+    ~Window();
+
+    Window(const Window&)            = delete;
+    Window& operator=(const Window&) = delete;
+
+    bool        ok() const { return addr_ != nullptr; }
+    const char* frame(uint64_t idx) const { // index in the whole recording
+      return data_ + (idx - first_) * frame_len_;
+    }
+
+  private:
+    void*       addr_;
+    size_t      len_;
+    const char* data_;
+    uint64_t    first_;
+    size_t      frame_len_;
+  };
+
+  MappedRecording(const std::string&, size_t);
+  ~MappedRecording();
+
+  MappedRecording(const MappedRecording&)            = delete;
+  MappedRecording& operator=(const MappedRecording&) = delete;
+
+  bool     ok() const { return fd_ != -1; }
+  uint64_t frames() const { return size_ / frame_len_; }
+  size_t   trailingBytes() const { return size_ % frame_len_; }
+
+private:
+  std::string filename_;
+  int         fd_;
+  uint64_t    size_;
+  size_t      frame_len_;
+};
+
+/*
+ * Positional reads of whole frames from a .bin file, for the tools that
+ * stream a recording with bounded memory. read() is safe from any thread.
+ */
+class RecordingFile {
+public:
+  RecordingFile(const std::string&, size_t);
+  ~RecordingFile();
+
+  RecordingFile(const RecordingFile&)            = delete;
+  RecordingFile& operator=(const RecordingFile&) = delete;
+
+  bool     ok() const { return fd_ != -1; }
+  bool     read(uint64_t, uint64_t, char*) const; // first frame, count
+  uint64_t frames() const { return size_ / frame_len_; }
+  size_t   trailingBytes() const { return size_ % frame_len_; }
+
+private:
+  int      fd_;
+  uint64_t size_;
+  size_t   frame_len_;
+};
@@ -1,16 +1,43 @@
 #include "server.hpp"
+#include "logger.hpp"
 
+#include <algorithm>
 #include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <csignal>
 #include <cstdint>
 #include <cstring>
-#include <iostream>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <optional>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#define coutr std::cout << "-> "
+// Value of a numeric argument sent by a client, nullopt if it is not one
+static std::optional<double> parseNumber(std::string_view s) {
+  while (!s.empty() && s.front() == ' ')
+    s.remove_prefix(1);
+  while (!s.empty() && s.back() == ' ')
+    s.remove_suffix(1);
+
+  double     value;
+  const auto r{std::from_chars(s.data(), s.data() + s.size(), value)};
+  if (s.empty() || r.ec != std::errc() || r.ptr != s.data() + s.size() ||
+      !std::isfinite(value))
+    return std::nullopt;
+  return value;
+}
 
 void Server::sendMessage(std::string_view message) {
   socklen_t client_address_length{sizeof(client_address_)};
@@ -18,21 +45,54 @@ void Server::sendMessage(std::string_view message) {
          (struct sockaddr*)&client_address_, client_address_length);
 }
 
-void Server::sendData(char* data) {
-  socklen_t client_address_length{sizeof(data_address_)};
-  sendto(data_socket_, data, BUF_LEN, 0, (struct sockaddr*)&data_address_,
-         client_address_length);
+void Server::sendMessage(const Acquirer* acq, std::string_view message) {
+  // Tell the boards apart in the replies
+  if (multi_board_)
+    sendMessage("[board " + std::to_string(acq->boardId()) + "] " +
+                std::string(message));
+  else
+    sendMessage(message);
+}
+
+bool Server::sendData(int board, uint64_t seq, uint64_t time_ns,
+                      const char* data, size_t len, uint8_t flags) {
+  std::unique_lock<std::mutex> lock(address_mutex_);
+  const struct sockaddr_in     address{data_address_};
+  lock.unlock();
 
-  // Print the first 10 bytes of the data
-  // for (int i = 0; i < 10; i++) {
-  //   std::cout << std::hex << std::setw(2) << std::setfill('0') <<
-  //   (int)data[i]
-  //             << " ";
-  // }
+  // Sequenced, so that the client can ask for the lost frames
+  char       datagram[sizeof(DataHeader) + MAX_UA_FRAME_LEN];
+  DataHeader header{DATA_MAGIC,
+                    DATA_VERSION,
+                    flags,
+                    static_cast<uint8_t>(board),
+                    1,
+                    static_cast<uint16_t>(len),
+                    seq,
+                    time_ns};
+  std::memcpy(datagram, &header, sizeof(header));
+  std::memcpy(&datagram[sizeof(header)], data, len);
+
+  return sendto(data_socket_, datagram, sizeof(header) + len, 0,
+                (struct sockaddr*)&address, sizeof(address)) != -1;
 }
 
-Server::Server(uint16_t port, std::string_view data_folder, float T2)
-    : port_(port), running_(true) {
+void Server::sendSpectrum(const char* message, size_t len) {
+  std::unique_lock<std::mutex> lock(address_mutex_);
+  const struct sockaddr_in     address{spectrum_address_};
+  lock.unlock();
+
+  sendto(data_socket_, message, len, 0, (struct sockaddr*)&address,
+         sizeof(address));
+}
+
+Server::Server(uint16_t port, std::string_view data_folder, float T2,
+               std::vector<Board>& boards)
+    : port_(port), running_(true), shutdown_(false),
+      multi_board_(boards.size() > 1), socket_(-1), data_socket_(-1),
+      retx_socket_(-1), epoll_fd_(-1), timer_fd_(-1), signal_fd_(-1),
+      multicast_(false), cal_timer_(-1), retx_timer_(-1), retx_sent_(0),
+      retx_missed_(0) {
   // Set up the server address
   server_address_.sin_family      = AF_INET;
   server_address_.sin_addr.s_addr = INADDR_ANY;
@@ -41,190 +101,1001 @@ Server::Server(uint16_t port, std::string_view data_folder, float T2)
   // Create a UDP socket for receiving commands and sending messages
   socket_ = socket(AF_INET, SOCK_DGRAM, 0);
   if (socket_ == -1) {
-    std::cerr << "Error creating socket" << '\n';
+    LOG_ERROR("Error creating socket");
     return;
   }
 
   if (bind(socket_, (struct sockaddr*)&server_address_,
            sizeof(server_address_)) == -1) {
-    std::cerr << "Error binding to port " << port_ << '\n';
+    LOG_ERROR("Error binding to port {}", port_);
     return;
   }
 
   // Create a UDP socket for sending data
   data_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
   if (data_socket_ == -1) {
-    std::cerr << "Error creating data socket" << '\n';
+    LOG_ERROR("Error creating data socket");
+    return;
+  }
+
+  // Retransmissions go through a second socket, queued behind the live data
+  retx_socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+  if (retx_socket_ == -1) {
+    LOG_ERROR("Error creating retransmission socket");
     return;
   }
 
-  acq_ = new Acquirer(data_folder, T2);
-  acq_->startThreads(this);
+  int priority{6}, tos{IPTOS_LOWDELAY};
+  setsockopt(data_socket_, SOL_SOCKET, SO_PRIORITY, &priority,
+             sizeof(priority));
+  setsockopt(data_socket_, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+  priority = 0;
+  tos      = IPTOS_THROUGHPUT;
+  setsockopt(retx_socket_, SOL_SOCKET, SO_PRIORITY, &priority,
+             sizeof(priority));
+  setsockopt(retx_socket_, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+
+  // One acquirer per board, all created before any thread uses acqs_
+  for (Board& board : boards)
+    acqs_.push_back(std::make_unique<Acquirer>(data_folder, T2, board));
+  for (auto& acq : acqs_)
+    acq->startThreads(this);
+  lost_frames_.resize(acqs_.size(), 0);
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ == -1) {
+    LOG_ERROR("Error creating the event loop");
+    return;
+  }
+
+  // Commands arrive in bursts: drain the socket at each wakeup
+  addSource(socket_, [this] {
+    while (running_ && receiveCommand()) {
+    }
+  });
+
+  // Bytes the PIC sends outside of a command exchange
+  for (auto& acq : acqs_) {
+    Board& board{acq->board()};
+    if (board.uart_fd != -1)
+      addSource(board.uart_fd, [&board] {
+        while (readUART(board) > 0) {
+        }
+      });
+  }
+
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec period {};
+  period.it_interval.tv_sec  = SERVER_TICK_MS / 1000;
+  period.it_interval.tv_nsec = (SERVER_TICK_MS % 1000) * 1000000L;
+  period.it_value            = period.it_interval;
+  if (timer_fd_ == -1 || timerfd_settime(timer_fd_, 0, &period, NULL) == -1)
+    LOG_ERROR("Error creating the timer");
+  else
+    addSource(timer_fd_, [this] { onTimer(); });
+
+  // SIGINT and SIGTERM are blocked by main and delivered here instead
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  signal_fd_ = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd_ == -1)
+    LOG_ERROR("Error creating the signal fd");
+  else
+    addSource(signal_fd_, [this] { onSignal(); });
+
+  addTickHandler([this] { checkRecorders(); });
+}
+
+bool Server::addSource(int fd, Handler handler) {
+  struct epoll_event ev {};
+  ev.events  = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    LOG_ERROR("Error adding fd {} to the event loop", fd);
+    return false;
+  }
+
+  sources_[fd] = std::move(handler);
+  return true;
+}
+
+void Server::removeSource(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+  sources_.erase(fd);
+}
+
+void Server::addTickHandler(Handler handler) {
+  tick_handlers_.push_back(std::move(handler));
+}
+
+int Server::addTimer(unsigned int period_ms, Handler handler) {
+  const int fd{timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)};
+  if (fd == -1)
+    return -1;
+
+  struct itimerspec period {};
+  period.it_interval.tv_sec  = period_ms / 1000;
+  period.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+  period.it_value            = period.it_interval;
+  if (timerfd_settime(fd, 0, &period, NULL) == -1 ||
+      !addSource(fd, [fd, handler = std::move(handler)] {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) > 0)
+          handler();
+      })) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+void Server::removeTimer(int fd) {
+  removeSource(fd);
+  close(fd);
 }
 
 void Server::run() {
-  std::cout << "Server listening on port " << port_ << '\n';
+  if (epoll_fd_ == -1)
+    return;
 
+  LOG_INFO("Server listening on port {}", port_);
+
+  struct epoll_event events[SERVER_MAX_EVENTS];
   while (running_) {
-    receiveCommand();
+    const int n{epoll_wait(epoll_fd_, events, SERVER_MAX_EVENTS, -1)};
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      LOG_ERROR("Error waiting for events: {}", strerror(errno));
+      break;
+    }
+
+    for (int i = 0; i < n && running_; i++) {
+      auto it{sources_.find(events[i].data.fd)};
+      if (it == sources_.end())
+        continue;
+
+      // A copy: the handler may remove its own source
+      Handler handler{it->second};
+      handler();
+    }
+  }
+}
+
+void Server::onTimer() {
+  uint64_t expirations;
+  if (read(timer_fd_, &expirations, sizeof(expirations)) <= 0)
+    return;
+
+  for (auto& handler : tick_handlers_)
+    handler();
+}
+
+void Server::onSignal() {
+  struct signalfd_siginfo info;
+  if (read(signal_fd_, &info, sizeof(info)) != sizeof(info))
+    return;
+
+  LOG_INFO("Received signal {}. Shutting down...", strsignal(info.ssi_signo));
+  sendMessage("Server shutting down.");
+
+  shutdown_ = true;
+  shutdown();
+}
+
+void Server::updateCalibrations() {
+  for (auto it = calibrations_.begin(); it != calibrations_.end();) {
+    if (it->second->update())
+      it = calibrations_.erase(it);
+    else
+      ++it;
+  }
+
+  if (calibrations_.empty()) {
+    removeTimer(cal_timer_);
+    cal_timer_ = -1;
+  }
+}
+
+void Server::retransmit() {
+  // Room for the raw frames, or for half as many calibrated frames
+  alignas(float) char datagram[sizeof(DataHeader) + RETX_BATCH * MAX_BUF_LEN];
+  char                frames[RETX_BATCH * MAX_BUF_LEN];
+  size_t              budget{RETX_BUDGET};
+
+  while (budget > 0 && !retx_queue_.empty()) {
+    Retransmission& r{retx_queue_.front()};
+    const uint64_t  head{r.acq->framesProduced()};
+    const uint64_t  history{r.acq->historyFrames()};
+
+    // Frames already overwritten in the history are lost for good
+    if (head > history && r.next < head - history) {
+      const uint64_t oldest{std::min(head - history, r.last + 1)};
+      retx_missed_ += oldest - r.next;
+      r.next = oldest;
+    }
+    // Frames not acquired yet cannot be requested
+    if (r.next > r.last || r.next >= head) {
+      if (r.next <= r.last)
+        retx_missed_ += r.last - r.next + 1;
+      retx_queue_.pop_front();
+      continue;
+    }
+
+    // Calibrated frames are twice as long: half as many per datagram
+    const FrameInfo& info{r.acq->frameInfo()};
+    const bool       ua{r.acq->microampStream()};
+    const size_t     frame_len{ua ? info.frame_len * 2 : info.frame_len};
+    const uint64_t   batch{static_cast<uint64_t>(ua ? RETX_BATCH / 2
+                                                        : RETX_BATCH)};
+    const uint64_t   n{std::min<uint64_t>(
+        {batch, budget, r.last - r.next + 1, head - r.next})};
+    if (r.acq->copyFrames(r.next, n, frames)) {
+      if (ua)
+        r.acq->board().cal.toMicroamps(
+            frames, n, info,
+            reinterpret_cast<float*>(&datagram[sizeof(DataHeader)]));
+      else
+        std::memcpy(&datagram[sizeof(DataHeader)], frames, n * frame_len);
+
+      DataHeader header{
+          DATA_MAGIC,
+          DATA_VERSION,
+          static_cast<uint8_t>(DATA_FLAG_RETRANSMIT |
+                               (ua ? DATA_FLAG_CALIBRATED : 0)),
+          static_cast<uint8_t>(r.acq->boardId()),
+          static_cast<uint16_t>(n),
+          static_cast<uint16_t>(frame_len),
+          r.next,
+          0};
+      std::memcpy(datagram, &header, sizeof(header));
+      sendto(retx_socket_, datagram, sizeof(header) + n * frame_len, 0,
+             (struct sockaddr*)&data_address_, sizeof(data_address_));
+      retx_sent_ += n;
+    } else {
+      retx_missed_ += n;
+    }
+
+    r.next += n;
+    budget -= n;
+    if (r.next > r.last)
+      retx_queue_.pop_front();
+  }
+
+  if (retx_queue_.empty()) {
+    removeTimer(retx_timer_);
+    retx_timer_ = -1;
+  }
+}
+
+void Server::shutdown() {
+  // Abort the calibrations, restoring T2
+  for (auto& [acq, cal] : calibrations_)
+    cal->abort();
+  calibrations_.clear();
+
+  // Stopping the acquisitions also saves the recordings
+  for (auto& acq : acqs_) {
+    acq->stop();
+    acq->stopThreads();
+  }
+  running_ = false;
+}
+
+bool Server::startMulticast(const struct in_addr& group, uint16_t port,
+                            int ttl, std::string_view iface) {
+  // Outgoing interface: an address or a name, default route otherwise
+  struct ip_mreqn mreq {};
+  if (!iface.empty()) {
+    const std::string name{iface};
+    if (inet_pton(AF_INET, name.c_str(), &mreq.imr_address) != 1) {
+      mreq.imr_ifindex = static_cast<int>(if_nametoindex(name.c_str()));
+      if (mreq.imr_ifindex == 0)
+        return false;
+    }
+  }
+
+  // Same options on both sockets: retransmissions go to the group too
+  const unsigned char ttl_byte{static_cast<unsigned char>(ttl)};
+  const unsigned char loop{1}; // local consumers on the Pi
+  for (int fd : {data_socket_, retx_socket_}) {
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl_byte,
+                   sizeof(ttl_byte)) == -1 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) ==
+            -1 ||
+        setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) ==
+            -1) {
+      LOG_ERROR("Error setting the multicast options: {}", strerror(errno));
+      return false;
+    }
+  }
+
+  struct sockaddr_in address {};
+  address.sin_family = AF_INET;
+  address.sin_addr   = group;
+  address.sin_port   = htons(port);
+
+  std::lock_guard<std::mutex> lock(address_mutex_);
+  data_address_ = address;
+  multicast_    = true;
+  return true;
+}
+
+void Server::stopMulticast() {
+  std::lock_guard<std::mutex> lock(address_mutex_);
+  multicast_             = false;
+  data_address_          = spectrum_address_;
+  data_address_.sin_port = htons(port_ + 1);
+}
+
+void Server::checkRecorders() {
+  // Warn the client when a recorder could not keep up with the acquisition
+  for (size_t i = 0; i < acqs_.size(); i++) {
+    const uint64_t lost{acqs_[i]->lostFrames()};
+    if (lost < lost_frames_[i]) // a new recording started
+      lost_frames_[i] = 0;
+    if (lost > lost_frames_[i]) {
+      std::string message{"Recorder overrun: " +
+                          std::to_string(lost - lost_frames_[i]) +
+                          " frames lost (" + std::to_string(lost) +
+                          " in this recording)"};
+      LOG_INFO("{}", message);
+      sendMessage(acqs_[i].get(), message);
+      lost_frames_[i] = lost;
+    }
   }
 }
 
 Server::~Server() {
-  // Close the sockets
+  calibrations_.clear();
+  if (cal_timer_ != -1)
+    removeTimer(cal_timer_);
+  if (retx_timer_ != -1)
+    removeTimer(retx_timer_);
+
+  // Stop the acquirers before the sockets they send data to
+  for (auto& acq : acqs_)
+    acq->stopThreads();
+  acqs_.clear();
+
+  // Close the event loop and the sockets
+  if (signal_fd_ != -1)
+    close(signal_fd_);
+  if (timer_fd_ != -1)
+    close(timer_fd_);
+  if (epoll_fd_ != -1)
+    close(epoll_fd_);
   close(socket_);
   close(data_socket_);
-  std::cout << "Sockets closed." << '\n';
-  std::cout << "Server stopped." << '\n' << '\n';
+  close(retx_socket_);
+  LOG_INFO("Sockets closed.");
+  LOG_INFO("Server stopped.");
 }
 
-void Server::receiveCommand() {
+bool Server::receiveCommand() {
   char      buffer[1024];
   socklen_t client_address_length{sizeof(client_address_)};
 
-  const ssize_t bytes_received{recvfrom(socket_, buffer, sizeof(buffer), 0,
-                                        (struct sockaddr*)&client_address_,
-                                        &client_address_length)};
+  const ssize_t bytes_received{recvfrom(
+      socket_, buffer, sizeof(buffer), MSG_DONTWAIT,
+      (struct sockaddr*)&client_address_, &client_address_length)};
 
-  if (bytes_received <= 0) {
-    return;
+  // Nothing left to read (EAGAIN) or error
+  if (bytes_received < 0)
+    return false;
+  if (bytes_received == 0)
+    return true;
+
+  const std::string_view command{buffer, static_cast<size_t>(bytes_received)};
+  LOG_DEBUG("Command from {}:{}: {}", inet_ntoa(client_address_.sin_addr),
+            ntohs(client_address_.sin_port), command);
+  handleCommand(command);
+
+  return true;
+}
+
+void Server::handleCommand(std::string_view command) {
+  std::unique_lock<std::mutex> lock(address_mutex_);
+
+  // Spectra go to the client's port + 2
+  spectrum_address_.sin_family      = AF_INET;
+  spectrum_address_.sin_addr.s_addr = client_address_.sin_addr.s_addr;
+  spectrum_address_.sin_port        = htons(port_ + 2);
+
+  // The data follows the client, unless it goes to a multicast group
+  if (!multicast_) {
+    data_address_          = spectrum_address_;
+    data_address_.sin_port = htons(port_ + 1); // Use the client's port + 1
   }
+  lock.unlock();
 
-  std::string_view command(buffer, static_cast<size_t>(bytes_received));
+  // "@<id> <command>" addresses a single board, otherwise all of them
+  std::vector<Acquirer*> targets;
+  if (!command.empty() && command[0] == '@') {
+    const size_t space{command.find(' ')};
+    const int    id{atoi(std::string(command.substr(1, space - 1)).c_str())};
+    for (auto& acq : acqs_)
+      if (acq->boardId() == id)
+        targets.push_back(acq.get());
 
-  data_address_.sin_family = AF_INET;
-  data_address_.sin_addr.s_addr =
-      client_address_.sin_addr.s_addr;       // Use the client's IP address
-  data_address_.sin_port = htons(port_ + 1); // Use the client's port + 1
+    command = (space == std::string_view::npos) ? "" : command.substr(space + 1);
+    if (targets.empty()) {
+      LOG_WARN("Received command for unknown board {}", id);
+      sendMessage("Unknown board: " + std::to_string(id));
+      return;
+    }
+  } else {
+    for (auto& acq : acqs_)
+      targets.push_back(acq.get());
+  }
 
   if (command == "start") {
-    if (!acq_->acquiring_) {
-      coutr << "Received start command. Starting the acquisition..." << '\n';
-      acq_->start();
-      sendMessage("Started the acquisition!");
-    } else {
-      coutr << "Received start command, but the acquisition is already running."
-            << '\n';
-      sendMessage("The acquisition is already running.");
+    for (Acquirer* acq : targets) {
+      if (!acq->acquiring_) {
+        LOG_INFO("Received start command. Starting the acquisition...");
+        acq->start();
+        sendMessage(acq, "Started the acquisition!");
+      } else {
+        LOG_INFO("Received start command, but the acquisition is already "
+                 "running.");
+        sendMessage(acq, "The acquisition is already running.");
+      }
     }
   } else if (command.substr(0, 3) == "rec") {
+    if (command.length() < 5) {
+      LOG_WARN("Received rec command without a file name.");
+      sendMessage("Usage: rec <name>");
+      return;
+    }
     std::string_view filename{command.substr(4)};
 
-    if (!acq_->recording_) {
-      coutr << "Received rec command. Starting recording..." << '\n';
-      acq_->startRecording(filename);
-      sendMessage("Started recording!");
-    } else {
-      coutr << "Received rec command, but the recording is already running."
-            << '\n';
-      sendMessage("The server is already recording.");
+    for (Acquirer* acq : targets) {
+      if (!acq->recording_) {
+        LOG_INFO("Received rec command. Starting recording...");
+        // Tell apart the recordings of the boards
+        if (multi_board_)
+          acq->startRecording(std::string(filename) + "_b" +
+                              std::to_string(acq->boardId()));
+        else
+          acq->startRecording(filename);
+        sendMessage(acq, "Started recording!");
+      } else {
+        LOG_INFO(
+            "Received rec command, but the recording is already running.");
+        sendMessage(acq, "The server is already recording.");
+      }
     }
   } else if (command == "pause") {
-    if (acq_->recording_ && !acq_->paused_) {
-      coutr << "Received pause command. Pausing recording..." << '\n';
-      acq_->pauseRecording();
-      sendMessage("Paused recording!");
-    } else {
-      coutr << "Received pause command, but there is nothing to pause." << '\n';
-      sendMessage("The server is not recording.");
+    for (Acquirer* acq : targets) {
+      if (acq->recording_ && !acq->paused_) {
+        LOG_INFO("Received pause command. Pausing recording...");
+        acq->pauseRecording();
+        sendMessage(acq, "Paused recording!");
+      } else {
+        LOG_INFO("Received pause command, but there is nothing to pause.");
+        sendMessage(acq, "The server is not recording.");
+      }
     }
   } else if (command == "resume") {
-    if (acq_->recording_ && acq_->paused_) {
-      coutr << "Received resume command. Resuming recording..." << '\n';
-      acq_->resumeRecording();
-      sendMessage("Resumed recording!");
-    } else {
-      coutr << "Received resume command, but there is nothing to resume."
-            << '\n';
-      sendMessage("The server is already recording.");
+    for (Acquirer* acq : targets) {
+      if (acq->recording_ && acq->paused_) {
+        LOG_INFO("Received resume command. Resuming recording...");
+        acq->resumeRecording();
+        sendMessage(acq, "Resumed recording!");
+      } else {
+        LOG_INFO("Received resume command, but there is nothing to resume.");
+        sendMessage(acq, "The server is already recording.");
+      }
     }
   } else if (command.substr(0, 3) == "tag") {
-    if (acq_->recording_ && !acq_->paused_) {
-      std::string_view tag{command.substr(4)};
-      coutr << "Received tag: " << tag << '\n';
+    if (command.length() < 5) {
+      LOG_WARN("Received tag command without a text.");
+      sendMessage("Usage: tag <text>");
+      return;
+    }
+    std::string_view tag{command.substr(4)};
 
-      acq_->tagRecording(std::string(tag));
+    for (Acquirer* acq : targets) {
+      if (acq->recording_ && !acq->paused_) {
+        LOG_INFO("Received tag: {}", tag);
 
-      sendMessage("Tagged recording! (" + std::string(tag) + ")");
-    } else {
-      coutr << "Received tag command, but there is no recording." << '\n';
-      sendMessage("The server is not recording.");
+        acq->tagRecording(std::string(tag));
+
+        sendMessage(acq, "Tagged recording! (" + std::string(tag) + ")");
+      } else {
+        LOG_INFO("Received tag command, but there is no recording.");
+        sendMessage(acq, "The server is not recording.");
+      }
     }
   } else if (command == "stop") {
-    if (acq_->acquiring_) {
-      coutr << "Received stop command. Stopping the acquisition..." << '\n';
-      std::vector<std::string> files{acq_->stop()};
-      sendMessage("Stopped the acquisition!");
-      if (files.size() > 0) {
-        sendMessage("Stopped the recording!");
-        std::cout << "Recording saved to " << files[0] << '\n';
-        sendMessage("Recording saved to " + files[0]);
-        std::cout << "Tags saved to " << files[1] << '\n';
-        sendMessage("Tags saved to " + files[1]);
+    for (Acquirer* acq : targets) {
+      if (acq->acquiring_) {
+        LOG_INFO("Received stop command. Stopping the acquisition...");
+        std::vector<std::string> files{acq->stop()};
+        sendMessage(acq, "Stopped the acquisition!");
+        if (files.size() > 0) {
+          sendMessage(acq, "Stopped the recording!");
+          // One data file and one tags file per segment
+          for (size_t i = 0; i + 1 < files.size(); i += 2) {
+            LOG_INFO("Recording saved to {}", files[i]);
+            sendMessage(acq, "Recording saved to " + files[i]);
+            LOG_INFO("Tags saved to {}", files[i + 1]);
+            sendMessage(acq, "Tags saved to " + files[i + 1]);
+          }
+        }
+
+        std::string cadence{acq->cadenceReport()};
+        LOG_INFO("{}", cadence);
+        sendMessage(acq, cadence);
+      } else {
+        LOG_INFO("Received stop command, but the acquisition is already "
+                 "stopped.");
+        sendMessage(acq, "The acquisition is already stopped.");
       }
-    } else {
-      coutr << "Received stop command, but the acquisition is already stopped."
-            << '\n';
-      sendMessage("The acquisition is already stopped.");
     }
   } else if (command.substr(0, 3) == "sT2") {
+    const std::optional<double> T2{
+        command.length() > 4 ? parseNumber(command.substr(4)) : std::nullopt};
+    if (!T2 || *T2 <= 0) {
+      LOG_WARN("Received invalid sT2 command.");
+      sendMessage("Usage: sT2 <us>, us > 0");
+      return;
+    }
     std::string value{std::string(command.substr(4))};
 
-    coutr << "Received sT2 command with value " << value << '\n';
+    LOG_INFO("Received sT2 command with value {}", value);
+
+    for (Acquirer* acq : targets) {
+      if (acq->setT2(static_cast<float>(*T2)) == -1)
+        sendMessage(acq, "Error setting T2.");
+      else
+        sendMessage(acq, "T2 set to " + value + " \u03BCs!");
+    }
+  } else if (command.substr(0, 3) == "rot") {
+    // rot <MB> [<minutes>], 0 disables the limit
+    const size_t                space{command.find(' ', 4)};
+    const std::optional<double> mb{
+        command.length() > 4 ? parseNumber(command.substr(4, space - 4))
+                             : std::nullopt};
+    const std::optional<double> minutes{space == std::string_view::npos
+                                            ? 0
+                                            : parseNumber(command.substr(space))};
+
+    // Whole numbers only, small enough not to overflow in bytes and seconds
+    auto valid = [](const std::optional<double>& v, double max) {
+      return v && *v >= 0 && *v <= max && *v == std::floor(*v);
+    };
+    if (!valid(mb, UINT32_MAX) || !valid(minutes, UINT32_MAX / 60)) {
+      LOG_WARN("Received invalid rot command.");
+      sendMessage("Usage: rot <MB> [<minutes>], 0 disables the limit");
+      return;
+    }
+    const uint64_t     max_mb{static_cast<uint64_t>(*mb)};
+    const unsigned int max_minutes{static_cast<unsigned int>(*minutes)};
+
+    LOG_INFO("Received rot command: {} MB, {} min", max_mb, max_minutes);
+
+    for (Acquirer* acq : targets)
+      acq->setRotation(max_mb, max_minutes);
+    if (max_mb == 0 && max_minutes == 0)
+      sendMessage("Recording rotation disabled!");
+    else
+      sendMessage("Recordings rotate every " + std::to_string(max_mb) +
+                  " MB / " + std::to_string(max_minutes) +
+                  " min (from the next recording)!");
+  } else if (command.substr(0, 7) == "preroll") {
+    const std::optional<double> value{
+        command.length() > 8 ? parseNumber(command.substr(8)) : std::nullopt};
+    if (!value || *value < 0) {
+      LOG_WARN("Received invalid preroll command.");
+      sendMessage("Usage: preroll <seconds>, seconds >= 0");
+      return;
+    }
+    LOG_INFO("Received preroll command with value {}", *value);
+
+    for (Acquirer* acq : targets) {
+      float seconds{acq->setPreroll(static_cast<float>(*value))};
+      sendMessage(acq, "Pre-roll set to " + std::to_string(seconds) +
+                           " s (history " +
+                           std::to_string(acq->historySeconds()) + " s)!");
+    }
+  } else if (command.substr(0, 8) == "snapshot") {
+    std::string name{command.length() > 9 ? command.substr(9) : "snapshot"};
+    LOG_INFO("Received snapshot command.");
+
+    // Written in the background, the reply does not wait for the file
+    for (Acquirer* acq : targets) {
+      std::string filename{acq->snapshot(
+          multi_board_ ? name + "_b" + std::to_string(acq->boardId())
+                           : name)};
+      sendMessage(acq, "Saving history to " + filename);
+    }
+  } else if (command.substr(0, 4) == "spec") {
+    // spec on [nfft], spec off
+    std::stringstream ss{std::string(command.substr(4))};
+    std::string       state;
+    size_t            nfft{SPECTRUM_NFFT};
+    ss >> state >> nfft;
+
+    if (state == "on") {
+      LOG_INFO("Received spec on command.");
+      for (Acquirer* acq : targets) {
+        nfft = acq->startSpectrum(nfft);
+        sendMessage(acq, "Streaming the spectrum (" + std::to_string(nfft) +
+                             " points) to port " + std::to_string(port_ + 2) +
+                             "!");
+      }
+    } else if (state == "off") {
+      LOG_INFO("Received spec off command.");
+      for (Acquirer* acq : targets) {
+        acq->stopSpectrum();
+        sendMessage(acq, "Stopped the spectrum stream!");
+      }
+    } else {
+      LOG_WARN("Received invalid spec command.");
+      sendMessage("Usage: spec on [nfft] | spec off");
+    }
+  } else if (command.substr(0, 4) == "nack") {
+    // nack <first> [<last>]: retransmit the frames from the history
+    std::stringstream ss{std::string(command.substr(4))};
+    uint64_t          first{0};
+    uint64_t          last{0};
+
+    if (!(ss >> first)) {
+      std::stringstream reply;
+      reply << "Retransmitted " << retx_sent_ << " frames, " << retx_missed_
+            << " no longer available.";
+      sendMessage(reply.str());
+      return;
+    }
+    // The sequence numbers are per board
+    if (multi_board_ && targets.size() > 1) {
+      LOG_WARN("Received nack command without a board id.");
+      sendMessage("Usage: @<id> nack <first> [<last>]");
+      return;
+    }
+    if (!(ss >> last))
+      last = first;
+    if (last < first) {
+      sendMessage("Invalid nack range.");
+      return;
+    }
+    last = std::min<uint64_t>(last, first + RETX_MAX_PENDING - 1);
+
+    // Bound the frames waiting for retransmission
+    uint64_t pending{0};
+    for (const Retransmission& r : retx_queue_)
+      pending += r.last - r.next + 1;
+
+    for (Acquirer* acq : targets) {
+      if (pending >= RETX_MAX_PENDING) {
+        retx_missed_ += last - first + 1;
+        continue;
+      }
+      const uint64_t n{std::min(last - first + 1, RETX_MAX_PENDING - pending)};
+      retx_queue_.push_back(Retransmission{acq, first, first + n - 1});
+      retx_missed_ += (last - first + 1) - n;
+      pending += n;
+    }
+
+    if (!retx_queue_.empty() && retx_timer_ == -1)
+      retx_timer_ = addTimer(RETX_PERIOD_MS, [this] { retransmit(); });
+  } else if (command.substr(0, 3) == "cal") {
+    // cal [from <us>] [to <us>] [step <us>] [frames <n>] [margin <%>] [apply]
+    // cal stop
+    std::stringstream     ss{std::string(command.substr(3))};
+    Calibration::Settings settings;
+    std::string           key;
+    bool                  stop{false};
+    bool                  valid{true};
+    while (ss >> key) {
+      if (key == "apply")
+        settings.apply = true;
+      else if (key == "stop")
+        stop = true;
+      else if (key == "from")
+        valid = valid && static_cast<bool>(ss >> settings.from);
+      else if (key == "to")
+        valid = valid && static_cast<bool>(ss >> settings.to);
+      else if (key == "step")
+        valid = valid && static_cast<bool>(ss >> settings.step);
+      else if (key == "frames")
+        valid = valid && static_cast<bool>(ss >> settings.frames);
+      else if (key == "margin")
+        valid = valid && static_cast<bool>(ss >> settings.margin);
+      else
+        valid = false;
+    }
+
+    if (!valid) {
+      LOG_WARN("Received invalid cal command.");
+      sendMessage("Usage: cal [from <us>] [to <us>] [step <us>] [frames <n>] "
+                  "[margin <%>] [apply] | cal stop");
+    } else if (stop) {
+      LOG_INFO("Received cal stop command.");
+      for (Acquirer* acq : targets) {
+        auto it{calibrations_.find(acq)};
+        if (it != calibrations_.end()) {
+          it->second->abort();
+          calibrations_.erase(it);
+        } else {
+          sendMessage(acq, "No calibration running.");
+        }
+      }
+    } else {
+      LOG_INFO("Received cal command. Calibrating T2...");
+      for (Acquirer* acq : targets) {
+        if (calibrations_.count(acq) > 0) {
+          sendMessage(acq, "A calibration is already running.");
+          continue;
+        }
+        calibrations_[acq] = std::make_unique<Calibration>(
+            *acq, settings, [this, acq](std::string_view message) {
+              LOG_INFO("{}", message);
+              sendMessage(acq, message);
+            });
+      }
+    }
+
+    // Measure the running calibrations from the event loop
+    if (!calibrations_.empty() && cal_timer_ == -1)
+      cal_timer_ = addTimer(CAL_POLL_MS, [this] { updateCalibrations(); });
+    else if (calibrations_.empty() && cal_timer_ != -1) {
+      removeTimer(cal_timer_);
+      cal_timer_ = -1;
+    }
+  } else if (command.substr(0, 3) == "pid") {
+    // pid <ch> [out vg|id] [target <uA>] [kp|ki|kd <gain>] [min|max <value>]
+    //          [rate <per s>] [every <frames>] [on|off] [reset]
+    // pid: report the loops
+    std::stringstream ss{std::string(command.substr(3))};
+    int               ch{0};
+    if (!(ss >> ch)) {
+      for (Acquirer* acq : targets)
+        for (int c = 1; c <= FEEDBACK_CHANNELS; c++)
+          sendMessage(acq, acq->feedback().report(c));
+      return;
+    }
+
+    LOG_INFO("Received pid command for channel {}", ch);
+    for (Acquirer* acq : targets) {
+      Feedback& fb{acq->feedback()};
+      if (ch < 1 || ch > FEEDBACK_CHANNELS) {
+        sendMessage(acq, "Invalid pid channel: " + std::to_string(ch));
+        break;
+      }
+
+      Feedback::Settings settings{fb.settings(ch)};
+      std::stringstream  args{ss.str()};
+      std::string        key;
+      bool               valid{true};
+      bool               limits{false};
+      args >> ch;
+      while (valid && args >> key) {
+        if (key == "on" || key == "off") {
+          settings.enabled = (key == "on");
+        } else if (key == "reset") {
+          fb.resetStats(ch);
+        } else if (key == "out") {
+          std::string out;
+          args >> out;
+          valid = (out == "vg" || out == "id");
+          settings.output = (out == "id") ? Feedback::Output::Isetpoint
+                                          : Feedback::Output::VG;
+        } else if (key == "min" || key == "max") {
+          limits = true;
+          valid  = static_cast<bool>(
+              args >> ((key == "min") ? settings.min : settings.max));
+        } else if (key == "target") {
+          valid = static_cast<bool>(args >> settings.target);
+        } else if (key == "kp") {
+          valid = static_cast<bool>(args >> settings.kp);
+        } else if (key == "ki") {
+          valid = static_cast<bool>(args >> settings.ki);
+        } else if (key == "kd") {
+          valid = static_cast<bool>(args >> settings.kd);
+        } else if (key == "rate") {
+          valid = static_cast<bool>(args >> settings.rate);
+        } else if (key == "every") {
+          valid = static_cast<bool>(args >> settings.every);
+        } else {
+          valid = false;
+        }
+      }
 
-    if (acq_->setT2(stof(value)) == -1)
-      sendMessage("Error setting T2.");
+      if (!valid) {
+        sendMessage("Usage: pid <ch> [out vg|id] [target <uA>] [kp <gain>] "
+                    "[ki <gain>] [kd <gain>] [min <value>] [max <value>] "
+                    "[rate <per s>] [every <frames>] [on|off] [reset] | pid");
+        break;
+      }
+      // The whole range of the new output, unless given
+      if (settings.output != fb.settings(ch).output && !limits) {
+        settings.min = 0;
+        settings.max = Feedback::outputMax(settings.output);
+      }
+
+      if (!fb.configure(ch, settings))
+        sendMessage(acq,
+                    "No channel " + std::to_string(ch) + " on this board.");
+      else
+        sendMessage(acq, fb.report(ch));
+    }
+  } else if (command.substr(0, 5) == "mcast") {
+    // mcast <group> <port> [ttl] [iface], mcast off
+    std::stringstream ss{std::string(command.substr(5))};
+    std::string       group, iface;
+    int               port{0};
+    int               ttl{MCAST_TTL};
+
+    if (!(ss >> group)) {
+      sendMessage(multicast_
+                      ? "Multicasting the data to " +
+                            std::string(inet_ntoa(data_address_.sin_addr)) +
+                            ":" + std::to_string(ntohs(data_address_.sin_port))
+                      : std::string("Multicast off."));
+      return;
+    }
+
+    if (group == "off") {
+      LOG_INFO("Received mcast off command.");
+      stopMulticast();
+      sendMessage("Multicast off, sending the data to port " +
+                  std::to_string(port_ + 1) + "!");
+      return;
+    }
+
+    // The TTL and the interface are optional
+    struct in_addr addr;
+    std::string    ttl_arg;
+    const bool     valid{static_cast<bool>(ss >> port)};
+    if (ss >> ttl_arg && !ttl_arg.empty())
+      ttl = atoi(ttl_arg.c_str());
+    ss >> iface;
+    if (!valid || inet_pton(AF_INET, group.c_str(), &addr) != 1 ||
+        !IN_MULTICAST(ntohl(addr.s_addr)) || port <= 0 || port > 65535 ||
+        ttl < 0 || ttl > 255) {
+      LOG_WARN("Received invalid mcast command.");
+      sendMessage("Usage: mcast <group> <port> [ttl] [iface] | mcast off");
+      return;
+    }
+
+    LOG_INFO("Received mcast command: {}:{}, TTL {}", group, port, ttl);
+    if (!startMulticast(addr, static_cast<uint16_t>(port), ttl, iface))
+      sendMessage("Error setting up multicast on " +
+                  (iface.empty() ? std::string("the default interface")
+                                 : iface) +
+                  ".");
     else
-      sendMessage("T2 set to " + value + " \u03BCs!");
+      sendMessage("Multicasting the data to " + group + ":" +
+                  std::to_string(port) + "!");
+  } else if (command.substr(0, 5) == "scale") {
+    // scale [ua|raw]: units of the data stream
+    const std::string_view units{
+        command.substr(std::min<size_t>(command.size(), 6))};
+    if (units == "ua" || units == "raw") {
+      LOG_INFO("Received scale {} command.", units);
+      for (Acquirer* acq : targets)
+        acq->setMicroampStream(units == "ua");
+    } else if (!units.empty()) {
+      LOG_WARN("Received invalid scale command.");
+      sendMessage("Usage: scale [ua|raw]");
+      return;
+    }
+    for (Acquirer* acq : targets)
+      sendMessage(acq, std::string(acq->microampStream()
+                                       ? "Streaming calibrated \u03BCA. "
+                                       : "Streaming raw ADC words. ") +
+                           acq->board().cal.report());
+  } else if (command.substr(0, 3) == "log") {
+    // log [trace|debug|info|warn|error|off]
+    const std::string_view name{
+        command.substr(std::min<size_t>(command.size(), 4))};
+    if (!name.empty()) {
+      auto level{parseLogLevel(name)};
+      if (!level) {
+        LOG_WARN("Received invalid log command.");
+        sendMessage("Usage: log [trace|debug|info|warn|error|off]");
+        return;
+      }
+      logSetLevel(*level);
+      LOG_INFO("Received log command, level {}", logLevelName(*level));
+    }
+    sendMessage("Log level: " + std::string(logLevelName(log_level)) + ", " +
+                std::to_string(logDropped()) + " records dropped.");
+  } else if (command.substr(0, 7) == "cadence") {
+    if (command.length() > 8) {
+      // Below one frame period every interval would be a gap
+      const std::optional<double> k{parseNumber(command.substr(8))};
+      if (!k || *k <= 1) {
+        LOG_WARN("Received invalid cadence command.");
+        sendMessage("Usage: cadence [<gap factor>], gap factor > 1");
+        return;
+      }
+      LOG_INFO("Received cadence command with gap factor {}", *k);
+
+      for (Acquirer* acq : targets)
+        acq->setGapFactor(*k);
+      std::stringstream ss;
+      ss << "Gap factor set to " << *k << "!";
+      sendMessage(ss.str());
+    } else {
+      LOG_INFO("Received cadence command.");
+      for (Acquirer* acq : targets)
+        sendMessage(acq, acq->cadenceReport());
+    }
   }
   // else if (command == "reset")
   // {
-  // 	coutr << "Received reset command. Resetting the dsPIC..." << endl;
+  // 	LOG_INFO("Received reset command. Resetting the dsPIC...");
   // 	SendMessage("Resetting the dsPIC...");
 
   // 	ResetDSPIC();
   // }
   else if (command == "kill") {
-    coutr << "Received kill command. Exiting..." << '\n';
+    LOG_INFO("Received kill command. Exiting...");
     sendMessage("Received kill command. Exiting...");
 
-    acq_->stop();
-    acq_->stopThreads();
-    running_ = false;
-  } else if (command.substr(0, 4) == "vg01") {
-    std::string value{std::string(command.substr(5))};
-    coutr << "Received vg1 command with value " << value << '\n';
-
-    if (acq_->setVG(stod(value), 1) == -1)
-      sendMessage("Error setting VG1.");
-    else
-      sendMessage("VG1 set to " + value + " V!");
-  } else if (command.substr(0, 4) == "vg02") {
-    std::string value{std::string(command.substr(5))};
-    coutr << "Received vg2 command with value " << value << '\n';
-
-    if (acq_->setVG(stod(value), 2) == -1)
-      sendMessage("Error setting VG2.");
-    else
-      sendMessage("VG2 set to " + value + " V!");
-  } else if (command.substr(0, 4) == "id01") {
-    std::string value{std::string(command.substr(5))};
-    coutr << "Received i1 command with value " << value << '\n';
+    // The kill command always stops the whole server
+    shutdown();
+  } else if ((command.substr(0, 2) == "vg" || command.substr(0, 2) == "id") &&
+             command.length() > 2 && std::isdigit((unsigned char)command[2])) {
+    // vg01/vg02 <V>, id01/id02 <uA>
+    const bool             vg{command.substr(0, 2) == "vg"};
+    const size_t           space{command.find(' ')};
+    const std::string_view channel{command.substr(
+        2, (space == std::string_view::npos) ? space : space - 2)};
+    if (channel != "01" && channel != "02") {
+      LOG_WARN("Received {} command for an invalid channel.",
+               vg ? "vg" : "id");
+      sendMessage("Invalid channel " + std::string(channel) +
+                  ", use 01 or 02.");
+      return;
+    }
+    const int                   ch{channel == "02" ? 2 : 1};
+    const std::optional<double> number{
+        command.length() > 5 ? parseNumber(command.substr(5)) : std::nullopt};
+    if (!number) {
+      LOG_WARN("Received {}{} command without a valid value.",
+               vg ? "vg" : "i", ch);
+      sendMessage(vg ? "Usage: vg01|vg02 <V>" : "Usage: id01|id02 <uA>");
+      return;
+    }
+    const std::string value{command.substr(5)};
+    LOG_INFO("Received {}{} command with value {}", (vg ? "vg" : "i"), ch,
+             value);
 
-    if (acq_->setVsetpoint(stod(value), 1) == -1)
-      sendMessage("Error setting Isetpoint1.");
-    else
-      sendMessage("I1 set to " + value + " \u03BCA!");
-  } else if (command.substr(0, 4) == "id02") {
-    std::string value{std::string(command.substr(5))};
-    coutr << "Received i2 command with value " << value << '\n';
+    for (Acquirer* acq : targets) {
+      // The software loop owns the output while it runs
+      if (acq->feedback().drives(vg ? Feedback::Output::VG
+                                    : Feedback::Output::Isetpoint,
+                                 ch)) {
+        sendMessage(acq, "PID " + std::to_string(ch) + " drives this output, "
+                         "turn it off first (pid " + std::to_string(ch) +
+                         " off).");
+        continue;
+      }
 
-    if (acq_->setVsetpoint(stod(value), 2) == -1)
-      sendMessage("Error setting Isetpoint2.");
-    else
-      sendMessage("I2 set to " + value + " \u03BCA!");
+      if (vg) {
+        if (acq->setVG(*number, ch) == -1)
+          sendMessage(acq, "Error setting VG" + std::to_string(ch) + ".");
+        else
+          sendMessage(acq, "VG" + std::to_string(ch) + " set to " + value +
+                               " V!");
+      } else {
+        if (acq->setVsetpoint(*number, ch) == -1)
+          sendMessage(acq, "Error setting Isetpoint" + std::to_string(ch) +
+                               ".");
+        else
+          sendMessage(acq, "I" + std::to_string(ch) + " set to " + value +
+                               " \u03BCA!");
+      }
+    }
   } else {
-    coutr << "Received unknown command: " << std::string(command) << '\n';
+    LOG_WARN("Received unknown command: {}", command);
     sendMessage("Unknown command: " + std::string(command));
   }
 }
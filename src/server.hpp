@@ -1,35 +1,108 @@
 #pragma once
 
 #include "acquirer.hpp"
+#include "calibration.hpp"
+#include "data_protocol.hpp"
 
 #include <arpa/inet.h>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
 #include <sys/socket.h>
+#include <vector>
 
-#define MEM_SIZE 1024 * 1024 * 1024 // 1 GB
+#define SERVER_TICK_MS 1000 // period of the timer of the event loop
+#define SERVER_MAX_EVENTS 16
+#define MCAST_TTL         1 // default: the local network only
 
+#define RETX_PERIOD_MS   5     // period of the retransmissions
+#define RETX_BUDGET      256   // frames retransmitted per period at most
+#define RETX_BATCH       32    // frames per retransmitted datagram
+#define RETX_MAX_PENDING 65536 // frames queued for retransmission at most
+
+/*
+ * The server thread runs a single epoll loop: the command socket, the UARTs
+ * of the boards, a periodic timer and the termination signals are all
+ * sources of the same loop, each with its own handler. Other sources can be
+ * added with addSource() and periodic work with addTickHandler().
+ */
 class Server {
 public:
-  Server(uint16_t, std::string_view, float);
+  using Handler = std::function<void()>;
+
+  Server(uint16_t, std::string_view, float, std::vector<Board>&);
   ~Server();
   void run();
   void sendMessage(std::string_view);
-  void sendData(char*);
+  void sendMessage(const Acquirer*, std::string_view);
+  // Board, sequence number, timestamp, frame; false if the send failed
+  bool sendData(int, uint64_t, uint64_t, const char*, size_t, uint8_t = 0);
+  void sendSpectrum(const char*, size_t);
+
+  bool addSource(int, Handler); // called when the fd is readable
+  void removeSource(int);
+  void addTickHandler(Handler); // called every SERVER_TICK_MS
+  int  addTimer(unsigned int, Handler); // period in ms, returns the timer fd
+  void removeTimer(int);
+
+  // True if the server stopped because of SIGINT/SIGTERM
+  bool shutdownRequested() const { return shutdown_; }
 
 private:
   const uint16_t     port_;
   bool               running_;
+  bool               shutdown_;
+  const bool         multi_board_;
   int                socket_;
   int                data_socket_;
+  int                retx_socket_; // lower priority than data_socket_
+  int                epoll_fd_;
+  int                timer_fd_;
+  int                signal_fd_;
   struct sockaddr_in server_address_;
   struct sockaddr_in client_address_;
-  struct sockaddr_in data_address_;
+  bool               multicast_;
+
+  // Written by the event loop, read by the processing and spectrum threads
+  std::mutex         address_mutex_;
+  struct sockaddr_in data_address_; // the client, or the multicast group
+  struct sockaddr_in spectrum_address_;
+
+  std::vector<std::unique_ptr<Acquirer>> acqs_;
+  std::map<int, Handler>                 sources_;
+  std::vector<Handler>                   tick_handlers_;
+  std::vector<uint64_t>                  lost_frames_; // last seen, per board
+
+  std::map<Acquirer*, std::unique_ptr<Calibration>> calibrations_;
+  int                                               cal_timer_;
+
+  // Frames [next, last] of a board requested by the client
+  struct Retransmission {
+    Acquirer* acq;
+    uint64_t  next;
+    uint64_t  last;
+  };
 
-  Acquirer* acq_;
+  std::deque<Retransmission> retx_queue_;
+  int                        retx_timer_;
+  uint64_t                   retx_sent_;
+  uint64_t                   retx_missed_; // no longer in the history
 
-  void receiveCommand();
+  bool receiveCommand();
+  void handleCommand(std::string_view);
+  bool startMulticast(const struct in_addr&, uint16_t, int, std::string_view);
+  void stopMulticast();
+  void onTimer();
+  void onSignal();
+  void shutdown();
+  void checkRecorders();
+  void updateCalibrations();
+  void retransmit();
   void startThreads();
   void startRecording();
   void startRecording(std::string_view);
@@ -0,0 +1,100 @@
+/*
+ * ocmfet-shm-example: minimal local consumer of the shared-memory ring.
+ *
+ * Follows the frames of one board as they are published and prints, once
+ * per second, the frame rate, the frames lost by this reader and the mean
+ * drain current of each channel over the last second. A starting point for
+ * the local processing that does not need to go through the network.
+ */
+#include "frame_layout.hpp"
+#include "shm_reader.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#define EXAMPLE_POLL_US 200 // sleep when the ring is empty
+
+int main(int argc, char* argv[]) {
+  if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+    std::cerr << "Usage: " << argv[0] << " [board]" << '\n';
+    return 1;
+  }
+  const int board{(argc == 2) ? std::atoi(argv[1]) : 0};
+
+  using namespace std::chrono;
+
+  while (true) {
+    std::optional<ShmReader> reader;
+    reader.emplace(board);
+    if (!reader->ok()) {
+      std::this_thread::sleep_for(seconds(1));
+      continue;
+    }
+
+    const FrameInfo info{reader->frameInfo()};
+    std::cout << "Reading " << shmRingName(board) << ": " << info.name
+              << " board, " << reader->header().capacity << " frames" << '\n';
+
+    std::vector<uint16_t> raw(info.n_samples * info.n_channels);
+    std::vector<double>   sum(info.n_channels, 0.0);
+    char                  frame[MAX_BUF_LEN];
+    uint64_t              seq{0}, time_ns{0}, frames{0}, lost{0};
+    auto                  next_report{steady_clock::now() + seconds(1)};
+    bool                  closed{false};
+
+    while (!closed) {
+      switch (reader->next(seq, time_ns, frame)) {
+      case ShmReader::Status::Ok:
+        visitLayout(info.variant, [&](auto l) {
+          using L = decltype(l);
+          decodeFrame<L>(frame, raw.data());
+          for (size_t i = 0; i < L::n_samples; i++)
+            for (size_t ch = 0; ch < L::n_channels; ch++)
+              sum[ch] += reader->header().cal_gain[ch] *
+                             mapADCVto_uA(
+                                 mapRAWADCtoV(raw[i * L::n_channels + ch])) +
+                         reader->header().cal_offset[ch];
+        });
+        frames++;
+        break;
+      case ShmReader::Status::Empty:
+        std::this_thread::sleep_for(microseconds(EXAMPLE_POLL_US));
+        break;
+      case ShmReader::Status::Lapped:
+        break;
+      case ShmReader::Status::Closed:
+        std::cout << "Ring closed by the server" << '\n';
+        closed = true;
+        break;
+      }
+
+      const auto now{steady_clock::now()};
+      if (now < next_report)
+        continue;
+      next_report += seconds(1);
+
+      std::printf("%8llu frames/s  %6llu lost  T2 %.1f us",
+                  (unsigned long long)frames,
+                  (unsigned long long)(reader->lost() - lost), reader->T2());
+      for (size_t ch = 0; ch < info.n_channels; ch++)
+        std::printf("  I%zu %8.3f uA", ch + 1,
+                    frames ? sum[ch] / (double)(frames * info.n_samples)
+                           : 0.0);
+      std::printf("\n");
+      std::fflush(stdout);
+
+      frames = 0;
+      lost   = reader->lost();
+      std::fill(sum.begin(), sum.end(), 0.0);
+    }
+
+    reader.reset();
+    std::this_thread::sleep_for(seconds(1));
+  }
+}
@@ -0,0 +1,81 @@
+#include "shm_publisher.hpp"
+#include "logger.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+ShmPublisher::ShmPublisher(int board, const FrameInfo& info, float T2,
+                           const BoardCalibration& cal)
+    : name_(shmRingName(board)), header_(nullptr), slots_(nullptr), size_(0),
+      slot_size_(0), frame_len_(info.frame_len), mask_(SHM_FRAMES - 1) {
+  static_assert((SHM_FRAMES & (SHM_FRAMES - 1)) == 0,
+                "SHM_FRAMES must be a power of two");
+
+  // Slots aligned to 8 bytes, the header to a cache line
+  const size_t header_size{(sizeof(ShmHeader) + 63) & ~size_t{63}};
+  slot_size_ = (sizeof(ShmSlot) + frame_len_ + 7) & ~size_t{7};
+  size_      = header_size + SHM_FRAMES * slot_size_;
+
+  // Readers still attached to a previous ring keep their mapping
+  shm_unlink(name_.c_str());
+  const int fd{shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644)};
+  if (fd == -1) {
+    LOG_ERROR("Error creating the shared memory ring {}", name_);
+    return;
+  }
+  if (ftruncate(fd, static_cast<off_t>(size_)) == -1) {
+    LOG_ERROR("Error sizing the shared memory ring {}", name_);
+    close(fd);
+    shm_unlink(name_.c_str());
+    return;
+  }
+
+  void* addr{mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG_ERROR("Error mapping the shared memory ring {}", name_);
+    shm_unlink(name_.c_str());
+    return;
+  }
+
+  // The new object is zero-filled: all slots empty, head at 0
+  ShmHeader* header{static_cast<ShmHeader*>(addr)};
+  header->magic       = SHM_MAGIC;
+  header->version     = SHM_VERSION;
+  header->header_size = static_cast<uint32_t>(header_size);
+  header->slot_size   = static_cast<uint32_t>(slot_size_);
+  header->capacity    = SHM_FRAMES;
+  header->board       = static_cast<uint32_t>(board);
+  header->variant     = static_cast<uint32_t>(info.variant);
+  header->frame_len   = static_cast<uint32_t>(info.frame_len);
+  header->n_channels  = static_cast<uint32_t>(info.n_channels);
+  header->n_samples   = static_cast<uint32_t>(info.n_samples);
+  for (int ch = 1; ch <= BOARD_CAL_CHANNELS; ch++) {
+    header->cal_gain[ch - 1]   = cal.adc(ch).gain;
+    header->cal_offset[ch - 1] = cal.adc(ch).offset;
+  }
+  header->T2_us.store(T2, std::memory_order_relaxed);
+  header->live.store(1, std::memory_order_release);
+
+  header_ = header;
+  slots_  = static_cast<char*>(addr) + header_size;
+
+  LOG_INFO("Shared memory ring {}: {} kB ({} frames)", name_, size_ / 1024,
+           SHM_FRAMES);
+}
+
+ShmPublisher::~ShmPublisher() {
+  if (header_ == nullptr)
+    return;
+
+  // Tell the readers, they unmap on their side
+  header_->live.store(0, std::memory_order_release);
+  munmap(header_, size_);
+  shm_unlink(name_.c_str());
+}
+
+void ShmPublisher::setT2(float T2) {
+  if (header_ != nullptr)
+    header_->T2_us.store(T2, std::memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "board_calibration.hpp"
+#include "frame_layout.hpp"
+#include "shm_ring.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/*
+ * Server side of the shared-memory ring (see shm_ring.hpp). publish() is
+ * called by the processing thread only: a copy of the frame and three
+ * stores, no system call.
+ */
+class ShmPublisher {
+public:
+  ShmPublisher(int, const FrameInfo&, float, const BoardCalibration&);
+  ~ShmPublisher();
+
+  ShmPublisher(const ShmPublisher&)            = delete;
+  ShmPublisher& operator=(const ShmPublisher&) = delete;
+
+  bool ok() const { return header_ != nullptr; }
+  void setT2(float);
+
+  void publish(uint64_t seq, uint64_t time_ns, const char* frame) {
+    if (header_ == nullptr)
+      return;
+
+    ShmSlot* slot{reinterpret_cast<ShmSlot*>(slots_ + (seq & mask_) *
+                                                          slot_size_)};
+    slot->seq.store(2 * seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot->time_ns = time_ns;
+    std::memcpy(reinterpret_cast<char*>(slot + 1), frame, frame_len_);
+    slot->seq.store(2 * seq + 2, std::memory_order_release);
+    header_->head.store(seq + 1, std::memory_order_release);
+  }
+
+private:
+  std::string name_;
+  ShmHeader*  header_;
+  char*       slots_;
+  size_t      size_;
+  size_t      slot_size_;
+  size_t      frame_len_;
+  uint64_t    mask_;
+};
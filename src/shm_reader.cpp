@@ -0,0 +1,126 @@
+#include "shm_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ShmReader::ShmReader(int board)
+    : header_(nullptr), slots_(nullptr), size_(0), pos_(0), lost_(0) {
+  open(shmRingName(board));
+}
+
+ShmReader::ShmReader(const std::string& name)
+    : header_(nullptr), slots_(nullptr), size_(0), pos_(0), lost_(0) {
+  open(name);
+}
+
+ShmReader::~ShmReader() {
+  if (header_ != nullptr)
+    munmap(const_cast<ShmHeader*>(header_), size_);
+}
+
+void ShmReader::open(const std::string& name) {
+  const int fd{shm_open(name.c_str(), O_RDONLY, 0)};
+  if (fd == -1) {
+    std::cerr << "Error opening the shared memory ring " << name << '\n';
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 ||
+      static_cast<size_t>(st.st_size) < sizeof(ShmHeader)) {
+    std::cerr << "Invalid shared memory ring " << name << '\n';
+    close(fd);
+    return;
+  }
+
+  size_ = st.st_size;
+  void* addr{mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0)};
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "Error mapping the shared memory ring " << name << '\n';
+    return;
+  }
+
+  const ShmHeader* header{static_cast<const ShmHeader*>(addr)};
+  const bool       valid{
+      header->magic == SHM_MAGIC && header->version == SHM_VERSION &&
+      header->live.load(std::memory_order_acquire) == 1 &&
+      header->capacity > 0 &&
+      (header->capacity & (header->capacity - 1)) == 0 &&
+      header->frame_len <= MAX_BUF_LEN &&
+      header->slot_size >= sizeof(ShmSlot) + header->frame_len &&
+      header->header_size + header->capacity * header->slot_size <= size_};
+  if (!valid) {
+    std::cerr << "Invalid shared memory ring " << name << " (version "
+              << header->version << ")" << '\n';
+    munmap(addr, size_);
+    return;
+  }
+
+  header_ = header;
+  slots_  = static_cast<const char*>(addr) + header->header_size;
+  seekLatest();
+}
+
+FrameInfo ShmReader::frameInfo() const {
+  return ::frameInfo(static_cast<BoardVariant>(header_->variant));
+}
+
+float ShmReader::T2() const {
+  return header_->T2_us.load(std::memory_order_relaxed);
+}
+
+void ShmReader::seekLatest() {
+  pos_ = header_->head.load(std::memory_order_acquire);
+}
+
+void ShmReader::skip(uint64_t head) {
+  // Resume past the oldest frame, the server is about to overwrite it
+  const uint64_t capacity{header_->capacity};
+  const uint64_t resume{std::min(
+      head, head - std::min(head, capacity) +
+                std::min<uint64_t>(SHM_LAP_MARGIN, capacity / 2))};
+  const uint64_t target{std::max(resume, pos_ + 1)};
+  lost_ += target - pos_;
+  pos_ = target;
+}
+
+ShmReader::Status ShmReader::next(uint64_t& seq, uint64_t& time_ns,
+                                  char* frame) {
+  const uint64_t head{header_->head.load(std::memory_order_acquire)};
+  if (pos_ >= head)
+    return (header_->live.load(std::memory_order_acquire) == 1)
+               ? Status::Empty
+               : Status::Closed;
+
+  if (head - pos_ > header_->capacity) {
+    skip(head);
+    return Status::Lapped;
+  }
+
+  const ShmSlot* slot{reinterpret_cast<const ShmSlot*>(
+      slots_ + (pos_ & (header_->capacity - 1)) * header_->slot_size)};
+  const uint64_t expected{2 * pos_ + 2};
+
+  // Seqlock read: the word must be the same before and after the copy
+  if (slot->seq.load(std::memory_order_acquire) != expected) {
+    skip(header_->head.load(std::memory_order_acquire));
+    return Status::Lapped;
+  }
+  time_ns = slot->time_ns;
+  std::memcpy(frame, reinterpret_cast<const char*>(slot + 1),
+              header_->frame_len);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (slot->seq.load(std::memory_order_relaxed) != expected) {
+    skip(header_->head.load(std::memory_order_acquire));
+    return Status::Lapped;
+  }
+
+  seq = pos_++;
+  return Status::Ok;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "frame_layout.hpp"
+#include "shm_ring.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define SHM_LAP_MARGIN 1024 // frames skipped past the oldest one when lapped
+
+/*
+ * Reader of the shared-memory ring of a board (see shm_ring.hpp), for the
+ * local consumers. Each reader keeps its own position and never writes to
+ * the segment; next() copies one frame out and validates it against the
+ * slot sequence word. A reader that falls more than a ring behind loses
+ * frames: next() reports it once, counts them and resumes SHM_LAP_MARGIN
+ * frames after the oldest one still in the ring.
+ */
+class ShmReader {
+public:
+  enum class Status {
+    Ok,     // a frame was copied out
+    Empty,  // no new frame yet
+    Lapped, // frames were lost, see lost()
+    Closed  // the server closed the ring, open it again
+  };
+
+  explicit ShmReader(int);
+  explicit ShmReader(const std::string&);
+  ~ShmReader();
+
+  ShmReader(const ShmReader&)            = delete;
+  ShmReader& operator=(const ShmReader&) = delete;
+
+  bool             ok() const { return header_ != nullptr; }
+  const ShmHeader& header() const { return *header_; }
+  FrameInfo        frameInfo() const;
+  float            T2() const;
+  uint64_t         position() const { return pos_; }
+  uint64_t         lost() const { return lost_; }
+
+  Status next(uint64_t&, uint64_t&, char*); // seq, time_ns, frame
+  void   seekLatest(); // skip to the next frame published
+
+private:
+  void open(const std::string&);
+  void skip(uint64_t);
+
+  const ShmHeader* header_;
+  const char*      slots_;
+  size_t           size_;
+  uint64_t         pos_;
+  uint64_t         lost_;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Layout of the shared-memory ring the server publishes the frames of each
+ * board into, for the local consumers (POSIX shared memory object
+ * "/ocmfet_b<id>", read-only for the readers):
+ *
+ *   ShmHeader, padded to header_size bytes
+ *   capacity slots of slot_size bytes: ShmSlot, then the frame_len bytes of
+ *   the frame
+ *
+ * The server writes frame `seq` in slot seq % capacity, bracketed by the
+ * slot sequence word: 2 * seq + 1 while the frame is being written,
+ * 2 * seq + 2 once it is complete, then it advances `head` to seq + 1.
+ * A reader keeps its own position: to read frame `seq` it loads the slot
+ * word (acquire), copies the frame, then loads the word again. Both loads
+ * must return 2 * seq + 2: a smaller value means the frame is not written
+ * yet, a larger one that the reader was lapped (the frame is lost). There
+ * are no locks and no per-reader state in the segment, so any number of
+ * readers can attach without slowing the server down.
+ *
+ * All the fields are in the native byte order of the Pi (little-endian).
+ */
+#define SHM_MAGIC   0x464D434F // "OCMF"
+#define SHM_VERSION 2
+#define SHM_FRAMES  65536 // slots of the ring (about 23 s at T2 = 44 us)
+
+struct ShmHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t header_size;   // offset of the first slot
+  uint32_t slot_size;
+  uint64_t capacity;      // slots, a power of two
+  uint32_t board;
+  uint32_t variant;       // BoardVariant
+  uint32_t frame_len;
+  uint32_t n_channels;
+  uint32_t n_samples;     // per frame
+  double   cal_gain[2];   // calibration of each channel:
+  double   cal_offset[2]; // Ids = gain * nominal Ids + offset (uA)
+  std::atomic<float>    T2_us;
+  std::atomic<uint32_t> live; // 0 once the server closed the ring
+  alignas(64) std::atomic<uint64_t> head; // frames published
+};
+
+struct ShmSlot {
+  std::atomic<uint64_t> seq;     // see above
+  uint64_t              time_ns; // CLOCK_REALTIME at the ACK0 edge
+  // followed by frame_len bytes
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The ring needs address-free 64-bit atomics");
+
+inline std::string shmRingName(int board) {
+  return "/ocmfet_b" + std::to_string(board);
+}
@@ -0,0 +1,190 @@
+#include "spectrum.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+Spectrum::Spectrum(const FrameInfo& info, int board,
+                   const BoardCalibration& cal)
+    : info_(info), board_(board), cal_(cal), enabled_(false), dropped_(0),
+      T2_(0), reset_(false), nfft_(SPECTRUM_NFFT), fill_(0), averaged_(0),
+      window_power_(0) {}
+
+Spectrum::~Spectrum() { stop(); }
+
+void Spectrum::start(size_t nfft, float T2, Sink sink) {
+  stop();
+
+  nfft_     = nfft;
+  fill_     = 0;
+  averaged_ = 0;
+  fft_.emplace(nfft_);
+  block_.assign(info_.n_channels, std::vector<double>(nfft_));
+  avg_.assign(info_.n_channels, std::vector<double>(nfft_ / 2 + 1, 0.0));
+  window_       = hannWindow(nfft_);
+  window_power_ = 0;
+  for (double w : window_)
+    window_power_ += w * w;
+  z_.resize(nfft_);
+  makeBands();
+
+  T2_      = T2;
+  reset_   = false;
+  dropped_ = 0;
+  sink_    = std::move(sink);
+  enabled_ = true;
+  thread_  = std::jthread([this](std::stop_token st) { loop(st); });
+}
+
+void Spectrum::stop() {
+  enabled_ = false;
+  if (thread_.joinable()) {
+    thread_.request_stop();
+    thread_.join();
+  }
+}
+
+void Spectrum::setT2(float T2) {
+  T2_    = T2;
+  reset_ = true; // the average mixes sampling rates otherwise
+}
+
+void Spectrum::loop(std::stop_token st) {
+  using namespace std::chrono;
+
+  // Frames left over from a previous run
+  Frame frame;
+  while (queue_.pop(frame)) {
+  }
+
+  auto next_send{steady_clock::now() + milliseconds(SPECTRUM_PERIOD_MS)};
+
+  while (!st.stop_requested()) {
+    while (queue_.pop(frame)) {
+      if (reset_.exchange(false)) {
+        fill_     = 0;
+        averaged_ = 0;
+        for (auto& avg : avg_)
+          std::fill(avg.begin(), avg.end(), 0.0);
+      }
+
+      const unsigned char* p{reinterpret_cast<unsigned char*>(frame.data)};
+      for (size_t i = 0; i < info_.n_samples; i++) {
+        for (size_t ch = 0; ch < info_.n_channels; ch++, p += 2)
+          block_[ch][fill_] = cal_.uA(static_cast<int>(ch) + 1,
+                                      (p[0] << 8) | p[1]);
+
+        if (++fill_ == nfft_) {
+          transform();
+          // 50% overlap: the second half starts the next block
+          for (auto& block : block_)
+            std::copy(block.begin() + nfft_ / 2, block.end(), block.begin());
+          fill_ = nfft_ / 2;
+        }
+      }
+    }
+
+    const auto now{steady_clock::now()};
+    if (now >= next_send) {
+      if (averaged_ > 0)
+        send();
+      next_send += milliseconds(SPECTRUM_PERIOD_MS);
+      if (next_send < now)
+        next_send = now + milliseconds(SPECTRUM_PERIOD_MS);
+    }
+
+    std::this_thread::sleep_for(milliseconds(SPECTRUM_POLL_MS));
+  }
+}
+
+void Spectrum::transform() {
+  const size_t   n_ch{info_.n_channels};
+  const uint32_t depth{std::min<uint32_t>(averaged_ + 1, SPECTRUM_AVERAGE)};
+
+  // Two real channels per complex transform
+  for (size_t ch = 0; ch < n_ch; ch += 2) {
+    const bool pair{ch + 1 < n_ch};
+
+    double m0{0}, m1{0};
+    for (size_t i = 0; i < nfft_; i++) {
+      m0 += block_[ch][i];
+      if (pair)
+        m1 += block_[ch + 1][i];
+    }
+    m0 /= (double)nfft_;
+    m1 /= (double)nfft_;
+
+    for (size_t i = 0; i < nfft_; i++)
+      z_[i] = {(block_[ch][i] - m0) * window_[i],
+               pair ? (block_[ch + 1][i] - m1) * window_[i] : 0.0};
+    fft_->transform(z_.data());
+
+    // Mean over the first transforms, then exponential average
+    for (size_t b = 0; b <= nfft_ / 2; b++) {
+      const std::complex<double> zk{z_[b]};
+      const std::complex<double> zn{std::conj(z_[(nfft_ - b) % nfft_])};
+      avg_[ch][b] += (std::norm(0.5 * (zk + zn)) - avg_[ch][b]) / depth;
+      if (pair)
+        avg_[ch + 1][b] += (std::norm(0.5 * (zk - zn)) - avg_[ch + 1][b]) /
+                           depth;
+    }
+  }
+
+  averaged_++;
+}
+
+void Spectrum::makeBands() {
+  // Log-spaced band edges, at least one bin wide
+  const size_t n_bins{nfft_ / 2 + 1};
+  const double ratio{std::pow((double)n_bins, 1.0 / (SPECTRUM_BANDS - 1))};
+
+  bands_.clear();
+  double edge{1};
+  for (size_t b = 0; b < n_bins && bands_.size() < SPECTRUM_BANDS;) {
+    bands_.push_back(static_cast<uint16_t>(b));
+    edge *= ratio;
+    b = std::max<size_t>(b + 1, static_cast<size_t>(std::lround(edge)));
+  }
+}
+
+void Spectrum::send() {
+  const size_t n_bins{nfft_ / 2 + 1};
+  const size_t n_bands{bands_.size()};
+  const double fs{1e6 / T2_};
+  const double scale{1.0 / (fs * window_power_)};
+
+  SpectrumHeader header{{'O', 'S', 'P', 'C'},
+                        1,
+                        static_cast<uint8_t>(board_),
+                        static_cast<uint8_t>(info_.n_channels),
+                        0,
+                        static_cast<uint16_t>(nfft_),
+                        static_cast<uint16_t>(n_bands),
+                        static_cast<float>(fs),
+                        std::min<uint32_t>(averaged_, SPECTRUM_AVERAGE)};
+
+  message_.resize(sizeof(header) + n_bands * sizeof(uint16_t) +
+                  info_.n_channels * n_bands * sizeof(float));
+  char* p{message_.data()};
+  std::memcpy(p, &header, sizeof(header));
+  p += sizeof(header);
+  std::memcpy(p, bands_.data(), n_bands * sizeof(uint16_t));
+  p += n_bands * sizeof(uint16_t);
+
+  // One-sided PSD, mean of the bins of each band
+  for (size_t ch = 0; ch < info_.n_channels; ch++) {
+    for (size_t i = 0; i < n_bands; i++) {
+      const size_t first{bands_[i]};
+      const size_t last{(i + 1 < n_bands) ? bands_[i + 1] : n_bins};
+      double       sum{0};
+      for (size_t b = first; b < last; b++)
+        sum += avg_[ch][b] * ((b == 0 || b == nfft_ / 2) ? 1.0 : 2.0);
+
+      const float psd{static_cast<float>(sum * scale / (double)(last - first))};
+      std::memcpy(p, &psd, sizeof(psd));
+      p += sizeof(psd);
+    }
+  }
+
+  sink_(message_.data(), message_.size());
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "board_calibration.hpp"
+#include "fft.hpp"
+#include "frame_layout.hpp"
+#include "spsc_queue.hpp"
+
+#include <atomic>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#define SPECTRUM_NFFT      4096 // default transform length (samples)
+#define SPECTRUM_AVERAGE   16   // averaging depth (transforms)
+#define SPECTRUM_BANDS     256  // most bands sent per channel
+#define SPECTRUM_PERIOD_MS 250  // period of the spectrum messages
+#define SPECTRUM_POLL_MS   10   // period of the spectrum thread
+#define SPECTRUM_QUEUE     1024 // frames buffered for the spectrum thread
+
+/*
+ * Header of a spectrum message, followed by n_bands uint16 first bins of the
+ * bands, then n_channels x n_bands float32 PSD values in uA^2/Hz (mean of the
+ * bins of each band). Little-endian, no padding.
+ */
+struct __attribute__((packed)) SpectrumHeader {
+  char     magic[4]; // "OSPC"
+  uint8_t  version;
+  uint8_t  board;
+  uint8_t  n_channels;
+  uint8_t  reserved;
+  uint16_t nfft;
+  uint16_t n_bands;
+  float    fs_hz;
+  uint32_t averaged; // transforms in the average
+};
+
+/*
+ * Rolling power spectrum of each channel. The processing thread hands the
+ * frames over with push(), which never blocks (frames are dropped if the
+ * spectrum thread lags behind); the spectrum thread decodes them, computes
+ * Hann-windowed FFTs with 50% overlap, keeps an exponential average and
+ * sends a message every SPECTRUM_PERIOD_MS. The bins are grouped in
+ * log-spaced bands, keeping the low frequency bins as they are.
+ */
+class Spectrum {
+public:
+  using Sink = std::function<void(const char*, size_t)>;
+
+  Spectrum(const FrameInfo&, int, const BoardCalibration&);
+  ~Spectrum();
+
+  void start(size_t, float, Sink);
+  void stop();
+  void setT2(float);
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  void push(const char* frame) {
+    Frame f;
+    std::memcpy(f.data, frame, info_.frame_len);
+    if (!queue_.push(f))
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  uint64_t dropped() const { return dropped_; }
+  size_t   nfft() const { return nfft_; }
+
+private:
+  struct Frame {
+    char data[MAX_BUF_LEN];
+  };
+
+  void loop(std::stop_token);
+  void transform();
+  void send();
+  void makeBands();
+
+  const FrameInfo         info_;
+  const int               board_;
+  const BoardCalibration& cal_;
+
+  std::atomic_bool                 enabled_;
+  std::atomic<uint64_t>            dropped_;
+  std::atomic<float>               T2_;
+  std::atomic_bool                 reset_; // T2 changed
+  SpscQueue<Frame, SPECTRUM_QUEUE> queue_;
+  std::jthread                     thread_;
+  Sink                             sink_;
+
+  // Owned by the spectrum thread
+  size_t                            nfft_;
+  size_t                            fill_;
+  uint32_t                          averaged_;
+  std::optional<FFT>                fft_;
+  std::vector<std::vector<double>>  block_; // [channel][sample]
+  std::vector<std::vector<double>>  avg_;   // [channel][bin]
+  std::vector<double>               window_;
+  double                            window_power_;
+  std::vector<std::complex<double>> z_;
+  std::vector<uint16_t>             bands_; // first bin of each band
+  std::vector<char>                 message_;
+};
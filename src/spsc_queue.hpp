@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Bounded lock-free single-producer single-consumer queue. push() and pop()
+ * never block, so it can be used to hand data off the acquisition threads.
+ */
+template <typename T, size_t N> class SpscQueue {
+  static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+  // Producer side: returns false (and drops the item) if the queue is full
+  bool push(const T& item) {
+    const size_t head{head_.load(std::memory_order_relaxed)};
+    if (head - tail_.load(std::memory_order_acquire) == N)
+      return false;
+
+    buf_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side: returns false if the queue is empty
+  bool pop(T& item) {
+    const size_t tail{tail_.load(std::memory_order_relaxed)};
+    if (tail == head_.load(std::memory_order_acquire))
+      return false;
+
+    item = buf_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+private:
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  T buf_[N];
+};